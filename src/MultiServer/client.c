@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <stddef.h>
 #include "multi.h"
 
 static void bufferInit(NetworkBuffer* buf)
@@ -15,50 +16,382 @@ static void bufferFree(NetworkBuffer* buf)
     buf->data = NULL;
 }
 
+/**
+ * Double the capacity of a full ring buffer, up to BUFFER_SIZE.
+ * @return 0 on success, -1 if the buffer is saturated
+ */
+static int bufferGrow(NetworkBuffer* buf)
+{
+    char* newData;
+    uint32_t newCapacity;
+    uint32_t wrapped;
+
+    newCapacity = buf->capacity * 2;
+    if (newCapacity > BUFFER_SIZE)
+        return -1;
+    newData = realloc(buf->data, newCapacity);
+    if (!newData)
+        return -1;
+
+    /* Move the wrapped part after the old end */
+    if (buf->pos + buf->size > buf->capacity)
+    {
+        wrapped = buf->pos + buf->size - buf->capacity;
+        memcpy(newData + buf->capacity, newData, wrapped);
+    }
+
+    buf->data = newData;
+    buf->capacity = newCapacity;
+    return 0;
+}
+
+/**
+ * Copy bytes from the head of a ring buffer without consuming them.
+ */
+static void bufferPeek(const NetworkBuffer* buf, void* dst, uint32_t size)
+{
+    uint32_t first;
+
+    first = buf->capacity - buf->pos;
+    if (first > size)
+        first = size;
+    memcpy(dst, buf->data + buf->pos, first);
+    memcpy((char*)dst + first, buf->data, size - first);
+}
+
+/**
+ * Get the byte at an offset into a ring buffer.
+ */
+static uint8_t bufferByte(const NetworkBuffer* buf, uint32_t off)
+{
+    return (uint8_t)buf->data[(buf->pos + off) & (buf->capacity - 1)];
+}
+
+/**
+ * Get size bytes at an offset into a ring buffer, in place unless they
+ * wrap around, in which case they are copied to scratch.
+ */
+static const char* bufferView(const NetworkBuffer* buf, uint32_t off, uint32_t size, char* scratch)
+{
+    uint32_t pos;
+    uint32_t first;
+
+    pos = (buf->pos + off) & (buf->capacity - 1);
+    first = buf->capacity - pos;
+    if (first >= size)
+        return buf->data + pos;
+    memcpy(scratch, buf->data + pos, first);
+    memcpy(scratch + first, buf->data, size - first);
+    return scratch;
+}
+
+/**
+ * Drop bytes from the head of a ring buffer.
+ */
+static void bufferConsume(NetworkBuffer* buf, uint32_t size)
+{
+    buf->pos = (buf->pos + size) & (buf->capacity - 1);
+    buf->size -= size;
+    if (buf->size == 0)
+        buf->pos = 0;
+}
+
+static void txInit(TxQueue* tx)
+{
+    tx->slots = NULL;
+    tx->head = 0;
+    tx->count = 0;
+    tx->capacity = 0;
+    tx->size = 0;
+}
+
+static void txFree(TxQueue* tx, FramePool* pool)
+{
+    for (uint32_t i = 0; i < tx->count; ++i)
+        framePoolPut(pool, tx->slots[(tx->head + i) & (tx->capacity - 1)].frame);
+    free(tx->slots);
+    tx->slots = NULL;
+    tx->count = 0;
+    tx->size = 0;
+}
+
+static TxSlot* txTail(TxQueue* tx)
+{
+    if (!tx->count)
+        return NULL;
+    return &tx->slots[(tx->head + tx->count - 1) & (tx->capacity - 1)];
+}
+
+static int txPush(TxQueue* tx, Frame* frame)
+{
+    TxSlot* newSlots;
+    uint32_t newCapacity;
+
+    /* Grow the ring, unwrapping it into the new storage */
+    if (tx->count == tx->capacity)
+    {
+        newCapacity = tx->capacity ? tx->capacity * 2 : 8;
+        newSlots = malloc(sizeof(TxSlot) * newCapacity);
+        if (!newSlots)
+            return -1;
+        for (uint32_t i = 0; i < tx->count; ++i)
+            newSlots[i] = tx->slots[(tx->head + i) & (tx->capacity - 1)];
+        free(tx->slots);
+        tx->slots = newSlots;
+        tx->capacity = newCapacity;
+        tx->head = 0;
+    }
+
+    tx->slots[(tx->head + tx->count) & (tx->capacity - 1)].frame = frame;
+    tx->slots[(tx->head + tx->count) & (tx->capacity - 1)].pos = 0;
+    tx->count++;
+    tx->size += frame->size;
+    return 0;
+}
+
+/**
+ * Get room for size private bytes at the end of the queue.
+ * The bytes are queued by txCommit.
+ */
+static char* txReserve(TxQueue* tx, FramePool* pool, uint32_t size)
+{
+    TxSlot* slot;
+    Frame* frame;
+
+    if (tx->size + size > BUFFER_SIZE)
+        return NULL;
+
+    /* Append to the private tail frame if it has room */
+    slot = txTail(tx);
+    if (slot && !slot->frame->shared && slot->frame->size + size <= slot->frame->capacity)
+        return slot->frame->data + slot->frame->size;
+
+    /* Start a new private frame */
+    frame = size > TX_CHUNK_SIZE ? frameNew(size) : framePoolGet(pool);
+    if (!frame)
+        return NULL;
+    if (txPush(tx, frame))
+    {
+        framePoolPut(pool, frame);
+        return NULL;
+    }
+    return frame->data;
+}
+
+static void txCommit(TxQueue* tx, uint32_t size)
+{
+    txTail(tx)->frame->size += size;
+    tx->size += size;
+}
+
+/**
+ * Drop size sent bytes from the front of the queue.
+ */
+static void txConsume(TxQueue* tx, FramePool* pool, uint32_t size)
+{
+    TxSlot* slot;
+    uint32_t left;
+
+    tx->size -= size;
+    while (size)
+    {
+        slot = &tx->slots[tx->head];
+        left = slot->frame->size - slot->pos;
+        if (size < left)
+        {
+            slot->pos += size;
+            return;
+        }
+        size -= left;
+        framePoolPut(pool, slot->frame);
+        tx->head = (tx->head + 1) & (tx->capacity - 1);
+        tx->count--;
+    }
+}
+
+/**
+ * Make sure the chunk holding a client ID is allocated.
+ * Must be called with the pool lock held.
+ */
+static int clientChunk(ClientPool* pool, int id)
+{
+    if (!pool->chunks[id / CLIENT_CHUNK_SIZE])
+        pool->chunks[id / CLIENT_CHUNK_SIZE] = calloc(CLIENT_CHUNK_SIZE, sizeof(Client));
+    return pool->chunks[id / CLIENT_CHUNK_SIZE] ? 0 : -1;
+}
+
 static int newClientId(App* app)
 {
-    /* Try to re-use a client ID */
-    for (int i = 0; i < app->clientSize; ++i)
+    ClientPool* pool;
+    int id;
+
+    /* Try to re-use a client ID freed by this worker */
+    id = app->clientFree;
+    if (id != -1)
     {
-        if (!app->clients[i].valid)
-            return i;
+        app->clientFree = APP_CLIENT(app, id)->nextFree;
+        return id;
     }
 
-    /* Resize the client array if needed */
-    if (app->clientSize == app->clientCapacity)
+    /* Allocate a new ID, and a new chunk if needed */
+    pool = app->clients;
+    pthread_mutex_lock(&pool->lock);
+    id = -1;
+    if (pool->size < CLIENT_MAX && clientChunk(pool, pool->size) == 0)
     {
-        app->clientCapacity *= 2;
-        app->clients = realloc(app->clients, sizeof(Client) * app->clientCapacity);
+        id = pool->size;
+        pool->size += pool->stride;
     }
+    pthread_mutex_unlock(&pool->lock);
 
-    return app->clientSize++;
+    return id;
 }
 
-Client* multiClientNew(App* app, int sock)
+/**
+ * Schedule the next keepalive or timeout check of a client.
+ */
+static void clientTimerSchedule(App* app, Client* client)
+{
+    uint32_t expire;
+
+    expire = TIMER_NONE;
+    if (client->state == CL_STATE_READY && app->keepalive)
+        expire = client->lastTx + app->keepalive + 1;
+    if (app->timeout && client->lastRx + app->timeout + 1 < expire)
+        expire = client->lastRx + app->timeout + 1;
+
+    if (expire == TIMER_NONE)
+        multiTimerCancel(app, client);
+    else
+        multiTimerSchedule(app, client, expire);
+}
+
+/**
+ * Start watching the socket of a client on this worker.
+ */
+static void clientWatch(App* app, Client* client)
 {
     struct epoll_event event;
-    int id;
+
+#if defined(MULTI_IO_URING)
+    if (app->uring)
+    {
+        multiUringWatch(app, client);
+        return;
+    }
+#endif
+
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.u32 = APP_EP_SOCK_CLIENT | client->id;
+    epoll_ctl(app->epoll, EPOLL_CTL_ADD, client->socket, &event);
+}
+
+/**
+ * Stop watching the socket of a client on this worker.
+ */
+static void clientUnwatch(App* app, Client* client)
+{
+#if defined(MULTI_IO_URING)
+    if (app->uring)
+    {
+        multiUringUnwatch(app, client);
+        return;
+    }
+#endif
+
+    epoll_ctl(app->epoll, EPOLL_CTL_DEL, client->socket, NULL);
+}
+
+/**
+ * Get room for size bytes in the tx queue of a client, flushing it first
+ * if it is full.
+ */
+static char* clientReserve(App* app, Client* client, uint32_t size)
+{
+    char* dst;
+
+    dst = txReserve(&client->tx, &app->framePool, size);
+    if (dst || !client->tx.size)
+        return dst;
+    if (multiClientFlushOut(app, client))
+        return NULL;
+    return txReserve(&client->tx, &app->framePool, size);
+}
+
+/**
+ * Send the tx queue of a client right away once it nears BUFFER_SIZE,
+ * otherwise at the end of the loop iteration.
+ * @return 0 on success, -1 on error
+ */
+static int clientFlush(App* app, Client* client)
+{
+    if (client->tx.size >= TX_FLUSH_SIZE)
+        return multiClientFlushOut(app, client);
+    multiClientFlushLater(app, client);
+    return 0;
+}
+
+/**
+ * Take a client off the list of clients to flush.
+ */
+static void clientFlushCancel(App* app, Client* client)
+{
+    if (!client->txQueued)
+        return;
+    client->txQueued = 0;
+    for (int i = 0; i < app->txDirtySize; ++i)
+    {
+        if (app->txDirty[i] == client->id)
+        {
+            app->txDirty[i] = app->txDirty[--app->txDirtySize];
+            break;
+        }
+    }
+}
+
+static Client* clientInit(App* app, int id, int sock)
+{
     Client* client;
+    uint32_t generation;
 
-    /* Get a client */
-    id = newClientId(app);
-    client = &app->clients[id];
+    client = APP_CLIENT(app, id);
+    generation = client->generation + 1;
     memset(client, 0, sizeof(*client));
+    client->generation = generation;
 
     /* Init */
     client->id = id;
     client->valid = 1;
     client->socket = sock;
     client->state = CL_STATE_NEW;
+    client->worker = app->workerId;
     client->ledgerId = -1;
+    client->lastRx = app->tick;
+    client->lastTx = app->tick;
+    client->timerExpire = TIMER_NONE;
+    clientTimerSchedule(app, client);
 
     bufferInit(&client->rx);
-    bufferInit(&client->tx);
+    txInit(&client->tx);
+    clientWatch(app, client);
 
-    /* Configure epoll */
-    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
-    event.data.u32 = APP_EP_SOCK_CLIENT | id;
-    epoll_ctl(app->epoll, EPOLL_CTL_ADD, sock, &event);
+    return client;
+}
+
+Client* multiClientNew(App* app, int sock)
+{
+    int id;
+    Client* client;
+
+    /* Get a client */
+    id = newClientId(app);
+    if (id == -1)
+    {
+        fprintf(stderr, "Server: Too many clients\n");
+        close(sock);
+        return NULL;
+    }
+    client = clientInit(app, id, sock);
 
     /* Log */
     fprintf(stderr, "Client #%d: Connected\n", id);
@@ -69,6 +402,43 @@ Client* multiClientNew(App* app, int sock)
     return client;
 }
 
+/**
+ * Take over a client handed off by another process, keeping its ID and
+ * the bytes it had already sent.
+ */
+Client* multiClientImport(App* app, int id, int sock, const void* rx, uint32_t rxSize)
+{
+    ClientPool* pool;
+    Client* client;
+    int ret;
+
+    pool = app->clients;
+    pthread_mutex_lock(&pool->lock);
+    ret = (id >= 0 && id < CLIENT_MAX) ? clientChunk(pool, id) : -1;
+    pthread_mutex_unlock(&pool->lock);
+    if (ret == -1 || APP_CLIENT(app, id)->valid)
+    {
+        fprintf(stderr, "Client #%d: Invalid handoff\n", id);
+        close(sock);
+        return NULL;
+    }
+    client = clientInit(app, id, sock);
+
+    /* Restore the received data */
+    while (client->rx.capacity < rxSize)
+    {
+        if (bufferGrow(&client->rx))
+        {
+            multiClientRemove(app, client);
+            return NULL;
+        }
+    }
+    memcpy(client->rx.data, rx, rxSize);
+    client->rx.size = rxSize;
+
+    return client;
+}
+
 void multiClientDisconnect(App* app, Client* client)
 {
     if (!client->valid)
@@ -87,33 +457,120 @@ void multiClientRemove(App* app, Client* client)
         return;
 
     /* Destroy the client */
+    multiTimerCancel(app, client);
+#if defined(MULTI_IO_URING)
+    if (app->uring)
+        multiUringUnwatch(app, client);
+#endif
     client->valid = 0;
     ledgerId = client->ledgerId;
     close(client->socket);
     bufferFree(&client->rx);
-    bufferFree(&client->tx);
+    txFree(&client->tx, &app->framePool);
 
     /* Un-ref the ledger */
     if (ledgerId != -1)
     {
+        multiLedgerUnsubscribe(app, client);
         app->ledgers[ledgerId].refCount--;
         if (app->ledgers[ledgerId].refCount == 0)
-            multiLedgerClose(app, ledgerId);
+            multiLedgerRelease(app, ledgerId);
     }
+
+    /* Recycle the ID */
+    client->nextFree = app->clientFree;
+    app->clientFree = client->id;
 }
 
-void multiClientEventInput(App* app, Client* client)
+/**
+ * Release a client whose socket was handed to another process.
+ * The ID now belongs to that process and is not recycled here.
+ * The other process shares the open file, so closing the socket would
+ * not drop it from the epoll set, it is unwatched first.
+ */
+void multiClientDetach(App* app, Client* client)
 {
     if (!client->valid)
         return;
 
-    /* If there is an error, exit early */
-    if (multiClientFlushIn(app, client))
-        return;
+    multiTimerCancel(app, client);
+    clientUnwatch(app, client);
+    client->valid = 0;
+    close(client->socket);
+    bufferFree(&client->rx);
+    txFree(&client->tx, &app->framePool);
+    app->migrated = 1;
+}
+
+/**
+ * Hand a client over to the worker owning its ledger.
+ * The client must not be touched by this worker afterwards.
+ */
+void multiClientMigrate(App* app, Client* client, int worker)
+{
+    App* dst;
+    uint64_t one;
+
+    dst = app->workers[worker];
+
+    /* Detach from this worker, the owner flushes the rest of the tx */
+    clientUnwatch(app, client);
+    multiTimerCancel(app, client);
+    clientFlushCancel(app, client);
+    client->worker = worker;
+    app->migrated = 1;
+
+    /* Queue on the owner */
+    pthread_mutex_lock(&dst->handoffLock);
+    if (dst->handoffSize == dst->handoffCapacity)
+    {
+        dst->handoffCapacity = dst->handoffCapacity ? dst->handoffCapacity * 2 : 16;
+        dst->handoffQueue = realloc(dst->handoffQueue, sizeof(int) * dst->handoffCapacity);
+    }
+    dst->handoffQueue[dst->handoffSize++] = client->id;
+    pthread_mutex_unlock(&dst->handoffLock);
+
+    one = 1;
+    write(dst->handoffEvent, &one, sizeof(one));
+}
+
+/**
+ * Take over a client migrated from another worker and resume its join.
+ */
+void multiClientAdopt(App* app, Client* client)
+{
+    client->lastRx = app->tick;
+    client->lastTx = app->tick;
+    client->timerExpire = TIMER_NONE;
+    clientTimerSchedule(app, client);
+
+    clientWatch(app, client);
+    if (client->tx.size)
+        multiClientFlushLater(app, client);
 
     multiClientProcess(app, client);
 }
 
+void multiClientEventInput(App* app, Client* client)
+{
+    int full;
+
+    if (!client->valid)
+        return;
+
+    /* Drain the socket, then run everything it sent. A saturated buffer
+     * stopped short of draining it, go again once it has been parsed */
+    for (;;)
+    {
+        if (multiClientFlushIn(app, client))
+            return;
+        full = client->rx.size == client->rx.capacity;
+        multiClientProcess(app, client);
+        if (!full || app->migrated || !client->valid || client->rx.size == client->rx.capacity)
+            return;
+    }
+}
+
 void multiClientProcess(App* app, Client* client)
 {
     if (!client->valid)
@@ -203,9 +660,30 @@ void multiClientProcessNew(App* app, Client* client)
 void multiClientProcessConnected(App* app, Client* client)
 {
     char data[20];
+    int shard;
+    int process;
+    int worker;
 
-    if (multiClientRead(app, client, data, 20))
+    if (multiClientPeek(app, client, data, 20))
+        return;
+
+    /* Ledgers live on a single worker, move there first */
+    shard = multiLedgerShard(app, data);
+    process = shard / app->workerCount;
+    worker = shard % app->workerCount;
+    if (process != app->processId)
+    {
+        fprintf(stderr, "Client #%d: Moving to process %d\n", client->id, process);
+        multiProcessHandoff(app, client, process);
+        return;
+    }
+    if (worker != app->workerId)
+    {
+        fprintf(stderr, "Client #%d: Moving to worker %d\n", client->id, worker);
+        multiClientMigrate(app, client, worker);
         return;
+    }
+    multiClientRead(app, client, NULL, 20);
 
     /* Copy the ledger base */
     memcpy(&client->ledgerBase, data + 16, 4);
@@ -216,8 +694,10 @@ void multiClientProcessConnected(App* app, Client* client)
         multiClientRemove(app, client);
         return;
     }
+    multiLedgerSubscribe(app, client->ledgerId, client);
 
-    if (app->ledgers[client->ledgerId].count < client->ledgerBase)
+    /* The base of a ledger still loading is checked once it is loaded */
+    if (!app->ledgers[client->ledgerId].load && app->ledgers[client->ledgerId].count < client->ledgerBase)
     {
         fprintf(stderr, "Client #%d: Invalid base %d\n", client->id, client->ledgerBase);
         multiClientRemove(app, client);
@@ -229,168 +709,223 @@ void multiClientProcessConnected(App* app, Client* client)
 
     /* Set state */
     client->state = CL_STATE_READY;
+    clientTimerSchedule(app, client);
 
     /* Transfer the ledger & run commands */
     multiClientTransferLedger(app, client);
     multiClientProcessReady(app, client);
 }
 
-void multiClientProcessReady(App* app, Client* client)
+/**
+ * Get the size of the command at an offset into the rx buffer of a client.
+ * @return The size, 0 if too little of it was received to tell, -1 if the
+ * command is invalid
+ */
+static int clientCommandSize(Client* client, uint32_t off)
 {
-    if (!client->valid)
-        return;
+    NetworkBuffer* rx;
+    uint32_t avail;
+    uint32_t end;
+    uint8_t op;
+    uint8_t size;
+    uint8_t count;
 
-    /* Process commands */
-    for (;;)
+    rx = &client->rx;
+    avail = rx->size - off;
+    op = bufferByte(rx, off);
+    switch (op)
     {
-        switch (client->op)
+    case OP_NONE:
+        return 1;
+    case OP_TRANSFER:
+        if (avail < 1 + sizeof(LedgerEntryHeader))
+            return 0;
+        size = bufferByte(rx, off + 1 + offsetof(LedgerEntryHeader, size));
+        if (size > 128)
         {
-        case OP_NONE:
-            if (multiClientRead(app, client, &client->op, 1))
-                return;
-            break;
-        case OP_TRANSFER:
-            multiClientCmdTransfer(app, client);
-            break;
-        case OP_MSG:
-            if (!multiClientCmdMsg(app, client))
-                return;
+            fprintf(stderr, "Client #%d: Invalid transfer size %d\n", client->id, size);
+            return -1;
+        }
+        return 1 + sizeof(LedgerEntryHeader) + size;
+    case OP_TRANSFER_BATCH:
+        if (client->version < VERSION_TRANSFER_BATCH)
             break;
-        default:
-            fprintf(stderr, "Client #%d: Invalid operation %d\n", client->id, client->op);
-            multiClientRemove(app, client);
-            return;
+        if (avail < 2)
+            return 0;
+        count = bufferByte(rx, off + 1);
+        if (count > TRANSFER_BATCH_MAX || !count)
+        {
+            fprintf(stderr, "Client #%d: Invalid transfer count %d\n", client->id, count);
+            return -1;
+        }
+
+        /* Walk the entries as far as they were received */
+        end = off + 2;
+        while (count--)
+        {
+            if (end + sizeof(LedgerEntryHeader) > rx->size)
+                return 0;
+            size = bufferByte(rx, end + offsetof(LedgerEntryHeader, size));
+            if (size > 128)
+            {
+                fprintf(stderr, "Client #%d: Invalid transfer size %d\n", client->id, size);
+                return -1;
+            }
+            end += sizeof(LedgerEntryHeader) + size;
+        }
+        return end - off;
+    case OP_MSG:
+        if (avail < 2)
+            return 0;
+        size = bufferByte(rx, off + 1);
+        if ((size > 32) || !size)
+        {
+            fprintf(stderr, "Client #%d: Invalid message size %d\n", client->id, size);
+            return -1;
         }
+        return 2 + size;
     }
+
+    fprintf(stderr, "Client #%d: Invalid operation %d\n", client->id, op);
+    return -1;
 }
 
-void multiClientCmdTransfer(App* app, Client* client)
+/**
+ * Write the entries of a complete OP_TRANSFER_BATCH command at an offset
+ * into the rx buffer of a client.
+ * They all land in the same pending batch of the ledger, so they are made
+ * durable and sent to the peers together.
+ * @return The number of entries
+ */
+static uint32_t clientCmdTransferBatch(App* app, Client* client, uint32_t off)
 {
-    char data[256];
-    LedgerEntryHeader header;
-
-    if (!client->valid)
-        return;
-
-    if (multiClientPeek(app, client, &header, sizeof(header)))
-        return;
+    char scratch[256];
+    const char* entry;
+    uint32_t count;
+    uint32_t size;
 
-    if (header.size > 128)
+    count = bufferByte(&client->rx, off + 1);
+    off += 2;
+    for (uint32_t i = 0; i < count; ++i)
     {
-        fprintf(stderr, "Client #%d: Invalid transfer size %d\n", client->id, header.size);
-        multiClientRemove(app, client);
-        return;
+        size = sizeof(LedgerEntryHeader) + bufferByte(&client->rx, off + offsetof(LedgerEntryHeader, size));
+        entry = bufferView(&client->rx, off, size, scratch);
+        multiClientCmdTransfer(app, client, entry);
+        off += size;
     }
 
-    if (multiClientRead(app, client, data, sizeof(header) + header.size))
-        return;
+    return count;
+}
 
-    fprintf(stderr, "Client #%d: Transfer %d bytes\n", client->id, header.size);
-    multiLedgerWrite(app, client->ledgerId, data);
+/**
+ * Run every complete command in the rx buffer of a client.
+ * Commands are decoded in place and consumed together once they have run,
+ * only a command wrapping around the end of the ring is copied. A command
+ * cut short stays in the buffer until the rest of it arrives.
+ */
+void multiClientProcessReady(App* app, Client* client)
+{
+    char scratch[256];
+    const char* cmd;
+    uint32_t off;
+    uint32_t count;
+    int size;
 
-    /* Set the op to NOP */
-    client->op = OP_NONE;
+    if (!client->valid)
+        return;
 
-    /* Notify all clients sharing the same ledger */
-    for (int i = 0; i < app->clientSize; ++i)
+    off = 0;
+    count = 0;
+    while (off < client->rx.size)
     {
-        if (!app->clients[i].valid)
-            continue;
-        if (app->clients[i].ledgerId != client->ledgerId)
-            continue;
-        multiClientTransferLedger(app, &app->clients[i]);
+        size = clientCommandSize(client, off);
+        if (size < 0)
+        {
+            multiClientRemove(app, client);
+            return;
+        }
+        if (!size || off + size > client->rx.size)
+            break;
+
+        /* A batch may be larger than the scratch, its entries are viewed
+         * one at a time */
+        if (bufferByte(&client->rx, off) == OP_TRANSFER_BATCH)
+        {
+            count += clientCmdTransferBatch(app, client, off);
+        }
+        else
+        {
+            cmd = bufferView(&client->rx, off, size, scratch);
+            switch (cmd[0])
+            {
+            case OP_TRANSFER:
+                multiClientCmdTransfer(app, client, cmd + 1);
+                count++;
+                break;
+            case OP_MSG:
+                multiClientCmdMsg(app, client, cmd + 1);
+                break;
+            }
+        }
+        if (!client->valid)
+            return;
+        off += size;
     }
+    bufferConsume(&client->rx, off);
+
+    if (count)
+        fprintf(stderr, "Client #%d: Transfer %u entries\n", client->id, count);
 }
 
-int multiClientCmdMsg(App* app, Client* client)
+/**
+ * Write an entry to the ledger of a client.
+ * Peers are notified once the entry is durable, see multiLedgerSync.
+ */
+void multiClientCmdTransfer(App* app, Client* client, const char* entry)
+{
+    multiLedgerWrite(app, client->ledgerId, entry);
+}
+
+/**
+ * Relay a message to the other ready clients of the ledger, straight from
+ * the rx buffer of the sender into their tx queues.
+ */
+void multiClientCmdMsg(App* app, Client* client, const char* msg)
 {
+    Ledger* ledger;
     Client* other;
     uint8_t size;
-    char    data[36];
+    char* dst;
 
-    if (!client->valid)
-        return 0;
-    if (multiClientPeek(app, client, &size, 1))
-        return 0;
-    if ((size > 32) || !size)
-    {
-        fprintf(stderr, "Client #%d: Invalid message size %d\n", client->id, size);
-        multiClientRemove(app, client);
-        return 0;
-    }
-
-    /* Make the message */
-    if (multiClientRead(app, client, data + 3, size + 1))
-        return 0;
-    data[0] = OP_MSG;
-    data[1] = (char)size;
-    memcpy(data + 2, &client->id, 2);
-
-    /* Set the op to NOP */
-    client->op = OP_NONE;
+    size = (uint8_t)msg[0];
 
-    /* Broadcast */
-    for (int i = 0; i < app->clientSize; ++i)
+    /* Broadcast, last first so removals are safe */
+    ledger = &app->ledgers[client->ledgerId];
+    for (int i = ledger->clientCount - 1; i >= 0; --i)
     {
-        if (i == client->id)
-            continue;
-        other = &app->clients[i];
-        if (!other->valid)
+        if (i >= ledger->clientCount)
             continue;
-        if (other->state != CL_STATE_READY)
+        other = APP_CLIENT(app, ledger->clients[i]);
+        if (other == client)
             continue;
-        if (other->ledgerId != client->ledgerId)
+        if (other->state != CL_STATE_READY || !other->valid)
             continue;
-        multiClientWrite(app, other, data, size + 4);
-    }
 
-    return 1;
-}
-
-/* TODO: Use a ring buffer instead */
-static void* bufferReserve(NetworkBuffer* buf, uint32_t size)
-{
-    uint32_t newCapacity;
-    char* newData;
-
-    /* First size check - move the stored data to the front */
-    if (buf->size + size > buf->capacity && buf->pos)
-    {
-        memmove(buf->data, buf->data + buf->pos, buf->size - buf->pos);
-        buf->size -= buf->pos;
-        buf->pos = 0;
-    }
-
-    /* Check for space */
-    if (buf->size + size > buf->capacity)
-    {
-        /* Compute the new capacity */
-        do
-        {
-            newCapacity = buf->capacity * 2;
-            if (newCapacity > BUFFER_SIZE)
-                newCapacity = BUFFER_SIZE;
-
-            /* If a max size buffer still doesn't fit, abort */
-            if (newCapacity == buf->capacity)
-                return NULL;
-        }
-        while (buf->size + size > newCapacity);
-
-        /* Realloc */
-        newData = realloc(buf->data, newCapacity);
-        if (!newData)
-            return NULL;
-        buf->data = newData;
-        buf->capacity = newCapacity;
+        dst = clientReserve(app, other, size + 4);
+        if (!dst)
+            continue;
+        dst[0] = OP_MSG;
+        dst[1] = (char)size;
+        memcpy(dst + 2, &client->id, 2);
+        memcpy(dst + 4, msg + 1, size);
+        txCommit(&other->tx, size + 4);
+        other->lastTx = app->tick;
+        clientFlush(app, other);
     }
-
-    /* We know we have enough space */
-    return buf->data + buf->size;
 }
 
 /**
- * Called periodically to handle timeouts.
+ * Called when the timer of a client is due.
  */
 void multiClientEventTimer(App* app, Client* client)
 {
@@ -400,20 +935,23 @@ void multiClientEventTimer(App* app, Client* client)
         return;
 
     /* Handle tx - send NOPs if we haven't sent anything in a while */
-    client->txTimeout++;
-    if (client->state == CL_STATE_READY && client->txTimeout > 3)
+    if (client->state == CL_STATE_READY && app->keepalive && app->tick - client->lastTx > app->keepalive)
     {
         nop = OP_NONE;
         multiClientWrite(app, client, &nop, 1);
+        if (!client->valid)
+            return;
     }
 
-    /* Handle rx */
-    client->rxTimeout++;
-    if (client->rxTimeout > 30)
+    /* Handle rx - drop clients that stopped talking */
+    if (app->timeout && app->tick - client->lastRx > app->timeout)
     {
         fprintf(stderr, "Client #%d: Timeout\n", client->id);
-        //multiClientRemove(app, client - app->clients);
+        multiClientDisconnect(app, client);
+        return;
     }
+
+    clientTimerSchedule(app, client);
 }
 
 /**
@@ -431,13 +969,168 @@ void multiClientEventOutput(App* app, Client* client)
     multiClientTransferLedger(app, client);
 }
 
-void multiClientTransferLedger(App* app, Client* client)
+static int clientWriteEntry(App* app, Client* client, const LedgerEntryHeader* entry)
+{
+    char* dst;
+    uint32_t size;
+
+    /* Copy the entry straight into the tx queue */
+    size = 1 + sizeof(*entry) + entry->size;
+    dst = clientReserve(app, client, size);
+    if (!dst)
+        return -1;
+    dst[0] = OP_TRANSFER;
+    memcpy(dst + 1, entry, size - 1);
+    txCommit(&client->tx, size);
+
+    /* Reset the tx timeout */
+    client->lastTx = app->tick;
+
+    /* Trigger output */
+    return clientFlush(app, client);
+}
+
+/**
+ * Get where a client stops catching up one entry at a time, the start of
+ * the next block it can be sent compressed or the end of the durable
+ * ledger.
+ */
+static uint32_t clientCatchUpEnd(App* app, Client* client)
 {
     Ledger* ledger;
-    LedgerEntryHeader* header;
-    uint32_t off;
+    uint32_t block;
+
+    ledger = &app->ledgers[client->ledgerId];
+    if (client->version < VERSION_TRANSFER_LZ4)
+        return ledger->durableCount;
+    block = (client->ledgerBase + LEDGER_LZ4_BLOCK - 1) / LEDGER_LZ4_BLOCK;
+    if ((block + 1) * LEDGER_LZ4_BLOCK > ledger->durableCount)
+        return ledger->durableCount;
+    return block * LEDGER_LZ4_BLOCK;
+}
+
+/**
+ * Queue the compressed block of entries starting at the base of a client.
+ * @return 0 on success, -1 when the tx queue is full or on error
+ */
+static int clientSendBlock(App* app, Client* client)
+{
+    Frame* frame;
+
+    frame = multiLedgerBlock(app, client->ledgerId, client->ledgerBase / LEDGER_LZ4_BLOCK);
+    if (!frame)
+    {
+        fprintf(stderr, "Client #%d: Catch-up error\n", client->id);
+        multiClientRemove(app, client);
+        return -1;
+    }
+    if (multiClientQueueFrame(app, client, frame))
+    {
+        /* Make room, if the socket fills up first it signals when it can
+         * take more */
+        if (multiClientFlushOut(app, client) || multiClientQueueFrame(app, client, frame))
+            return -1;
+    }
+    client->ledgerBase += LEDGER_LZ4_BLOCK;
+    multiClientFlushLater(app, client);
+    return 0;
+}
+
+/**
+ * Stream durable entries straight from ledger memory to the socket.
+ * Each entry is sent as an iovec pair (opcode, entry in the cache or mapping)
+ * without going through the tx queue. If an entry is only partially sent,
+ * the rest of it is queued so the frame stays whole.
+ * @return 0 when there is nothing left to stream from memory before end,
+ * -1 when the socket is full or errored
+ */
+static int clientStreamLedger(App* app, Client* client, uint32_t end)
+{
+    static const char kOpTransfer = OP_TRANSFER;
+    struct iovec iov[TX_IOV_MAX];
+    const LedgerEntryHeader* entries[TX_IOV_MAX / 2];
+    const LedgerEntryHeader* entry;
+    ssize_t ret;
     uint32_t size;
-    char buffer[512];
+    uint32_t entryId;
+    int count;
+    char* dst;
+
+    for (;;)
+    {
+        /* Anything already queued goes first */
+        if (client->tx.size)
+        {
+            if (multiClientFlushOut(app, client))
+                return -1;
+            if (client->tx.size)
+                return -1;
+        }
+
+        /* Gather the resident entries */
+        count = 0;
+        for (entryId = client->ledgerBase; entryId < end && count < TX_IOV_MAX / 2; ++entryId)
+        {
+            entry = multiLedgerEntry(app, client->ledgerId, entryId, NULL);
+            if (!entry)
+                break;
+            entries[count] = entry;
+            iov[count * 2].iov_base = (void*)&kOpTransfer;
+            iov[count * 2].iov_len = 1;
+            iov[count * 2 + 1].iov_base = (void*)entry;
+            iov[count * 2 + 1].iov_len = sizeof(*entry) + entry->size;
+            count++;
+        }
+        if (!count)
+            return 0;
+
+        /* Send */
+        ret = writev(client->socket, iov, count * 2);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+#if defined(MULTI_IO_URING)
+                multiUringWantOutput(app, client);
+#endif
+                return -1;
+            }
+            fprintf(stderr, "Client #%d: Write error %d\n", client->id, errno);
+            multiClientRemove(app, client);
+            return -1;
+        }
+        client->lastTx = app->tick;
+
+        /* Skip the entries that were fully sent */
+        for (int i = 0; i < count; ++i)
+        {
+            size = 1 + sizeof(*entries[i]) + entries[i]->size;
+            if ((size_t)ret < size)
+            {
+                /* Queue the rest of a partially sent entry */
+                if (ret)
+                {
+                    dst = txReserve(&client->tx, &app->framePool, size - ret);
+                    if (!dst)
+                        return -1;
+                    memcpy(dst, (const char*)entries[i] + ret - 1, size - ret);
+                    txCommit(&client->tx, size - ret);
+                    client->ledgerBase++;
+                }
+                break;
+            }
+            ret -= size;
+            client->ledgerBase++;
+        }
+    }
+}
+
+void multiClientTransferLedger(App* app, Client* client)
+{
+    Ledger* ledger;
+    const LedgerEntryHeader* entry;
+    char scratch[sizeof(LedgerEntryHeader) + 256];
+    uint32_t end;
 
     if (!client->valid)
         return;
@@ -447,46 +1140,49 @@ void multiClientTransferLedger(App* app, Client* client)
     ledger = &app->ledgers[client->ledgerId];
     for (;;)
     {
-        /* Check if we're at the end of the ledger */
-        if (ledger->count <= client->ledgerBase)
+        /* Check if we're at the end of the durable ledger */
+        if (ledger->durableCount <= client->ledgerBase)
             return;
 
-        /* Prepare the payload */
-        off = ledger->index[client->ledgerBase];
-        buffer[0] = OP_TRANSFER;
-        header = (LedgerEntryHeader*)(buffer + 1);
-        multiFilePread(ledger->fileData, header, off, sizeof(*header));
-        multiFilePread(ledger->fileData, buffer + 1 + sizeof(*header), off + sizeof(*header), header->size);
-        size = 1 + sizeof(*header) + header->size;
+        /* Whole blocks go compressed to the clients that support it */
+        end = clientCatchUpEnd(app, client);
+        if (client->ledgerBase == end)
+        {
+            if (clientSendBlock(app, client))
+                return;
+            continue;
+        }
 
-        /* Send the entry */
-        if (multiClientWrite(app, client, buffer, size))
+        /* Stream from memory while the socket keeps up */
+        if (clientStreamLedger(app, client, end))
             return;
 
-        /* Entry is either sent or in the tx queue - either way, we're past it */
-        client->ledgerBase++;
+        while (client->ledgerBase < end)
+        {
+            /* Send the entry */
+            entry = multiLedgerEntry(app, client->ledgerId, client->ledgerBase, scratch);
+            if (clientWriteEntry(app, client, entry))
+                return;
+
+            /* Entry is either sent or in the tx queue - either way, we're past it */
+            client->ledgerBase++;
+        }
     }
 }
 
 int multiClientPeek(App* app, Client* client, void* dst, uint32_t size)
 {
+    (void)app;
+
     if (!client->valid)
         return -1;
 
-    /* Do we need to read? */
-    if (client->rx.size - client->rx.pos < size)
-    {
-        /* Read */
-        if (multiClientFlushIn(app, client))
-            return -1;
-
-        /* Check again */
-        if (client->rx.size - client->rx.pos < size)
-            return -1;
-    }
+    /* The socket is drained before parsing, see multiClientEventInput */
+    if (client->rx.size < size)
+        return -1;
 
     if (dst)
-        memcpy(dst, client->rx.data + client->rx.pos, size);
+        bufferPeek(&client->rx, dst, size);
     return 0;
 }
 
@@ -494,12 +1190,7 @@ int multiClientRead(App* app, Client* client, void* dst, uint32_t size)
 {
     if (multiClientPeek(app, client, dst, size))
         return -1;
-    client->rx.pos += size;
-    if (client->rx.pos == client->rx.size)
-    {
-        client->rx.pos = 0;
-        client->rx.size = 0;
-    }
+    bufferConsume(&client->rx, size);
     return 0;
 }
 
@@ -519,19 +1210,19 @@ int multiClientWrite(App* app, Client* client, const void* data, uint32_t size)
         return -1;
 
     /* Allocate */
-    dst = bufferReserve(&client->tx, size);
+    dst = clientReserve(app, client, size);
     if (!dst)
         return -1;
 
     /* Copy */
     memcpy(dst, data, size);
-    client->tx.size += size;
+    txCommit(&client->tx, size);
 
     /* Reset the tx timeout */
-    client->txTimeout = 0;
+    client->lastTx = app->tick;
 
     /* Trigger output */
-    return multiClientFlushOut(app, client);
+    return clientFlush(app, client);
 }
 
 /**
@@ -541,51 +1232,39 @@ int multiClientWrite(App* app, Client* client, const void* data, uint32_t size)
  */
 int multiClientFlushIn(App* app, Client* client)
 {
+    struct iovec iov[2];
+    NetworkBuffer* rx;
     ssize_t ret;
-    void* newData;
-    uint32_t newCapacity;
-
-    (void)app;
+    uint32_t tail;
+    uint32_t space;
 
     if (!client->valid)
         return -1;
 
+#if defined(MULTI_IO_URING)
+    /* Data arrives through the multishot recv, see multiClientReceive */
+    if (client->watch & CLIENT_WATCH_RECV)
+        return 0;
+#endif
+
+    rx = &client->rx;
     for (;;)
     {
-        if (client->rx.size == client->rx.capacity)
-        {
-            /* The buffer is full - expand if possible */
-            if (client->rx.pos)
-            {
-                /* Expand by relocating */
-                memmove(client->rx.data, client->rx.data + client->rx.pos, client->rx.size - client->rx.pos);
-                client->rx.size -= client->rx.pos;
-                client->rx.pos = 0;
-            }
-            else
-            {
-                /* Expand by realloc */
-                newCapacity = client->rx.capacity * 2;
-                if (newCapacity > BUFFER_SIZE)
-                    newCapacity = BUFFER_SIZE;
-                if (newCapacity == client->rx.capacity)
-                {
-                    /* Buffer is saturated */
-                    return 0;
-                }
-
-                newData = realloc(client->rx.data, newCapacity);
-                if (!newData)
-                {
-                    /* Out of memory, but not a read error */
-                    return 0;
-                }
-                client->rx.data = newData;
-                client->rx.capacity = newCapacity;
-            }
-        }
+        /* The buffer is full - expand if possible */
+        if (rx->size == rx->capacity && bufferGrow(rx))
+            return 0;
 
-        ret = recv(client->socket, client->rx.data + client->rx.size, client->rx.capacity - client->rx.size, 0);
+        /* Receive into the free part of the ring, which may wrap */
+        tail = (rx->pos + rx->size) & (rx->capacity - 1);
+        space = rx->capacity - rx->size;
+        iov[0].iov_base = rx->data + tail;
+        iov[0].iov_len = rx->capacity - tail;
+        if (iov[0].iov_len > space)
+            iov[0].iov_len = space;
+        iov[1].iov_base = rx->data;
+        iov[1].iov_len = space - iov[0].iov_len;
+
+        ret = readv(client->socket, iov, iov[1].iov_len ? 2 : 1);
         if (ret == 0)
         {
             /* Sane disconnect */
@@ -594,13 +1273,13 @@ int multiClientFlushIn(App* app, Client* client)
         }
         else if (ret > 0)
         {
-            client->rx.size += ret;
+            rx->size += ret;
         }
         else
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                client->rxTimeout = 0;
+                client->lastRx = app->tick;
                 return 0;
             }
             fprintf(stderr, "Client #%d: Read error %d\n", client->id, errno);
@@ -610,6 +1289,64 @@ int multiClientFlushIn(App* app, Client* client)
     }
 }
 
+/**
+ * Append received bytes to the rx buffer of a client.
+ * @return 0 on success, -1 if the buffer would overflow
+ */
+int multiClientReceive(App* app, Client* client, const void* data, uint32_t size)
+{
+    NetworkBuffer* rx;
+    uint32_t tail;
+    uint32_t first;
+
+    rx = &client->rx;
+    while (rx->capacity - rx->size < size)
+    {
+        if (bufferGrow(rx))
+            return -1;
+    }
+
+    tail = (rx->pos + rx->size) & (rx->capacity - 1);
+    first = rx->capacity - tail;
+    if (first > size)
+        first = size;
+    memcpy(rx->data + tail, data, first);
+    memcpy(rx->data, (const char*)data + first, size - first);
+    rx->size += size;
+    client->lastRx = app->tick;
+
+    return 0;
+}
+
+/**
+ * Queue a shared frame without copying it.
+ * A shared frame is accepted as long as the queue is not full, even if it
+ * goes past BUFFER_SIZE, so large frames are never starved.
+ * The caller is responsible for flushing.
+ * @param client The client
+ * @param frame The frame
+ * @return 0 on success, -1 on error
+ */
+int multiClientQueueFrame(App* app, Client* client, Frame* frame)
+{
+    if (!client->valid)
+        return -1;
+    if (client->tx.size >= BUFFER_SIZE)
+        return -1;
+
+    frame->shared = 1;
+    if (txPush(&client->tx, frameRef(frame)))
+    {
+        framePoolPut(&app->framePool, frame);
+        return -1;
+    }
+
+    /* Reset the tx timeout */
+    client->lastTx = app->tick;
+
+    return 0;
+}
+
 /**
  * Flush buffered data to the client.
  * @param client The client
@@ -617,36 +1354,89 @@ int multiClientFlushIn(App* app, Client* client)
  */
 int multiClientFlushOut(App* app, Client* client)
 {
+    struct iovec iov[TX_IOV_MAX];
+    TxSlot* slot;
+    TxQueue* tx;
     ssize_t ret;
-
-    (void)app;
+    int iovCount;
 
     if (!client->valid)
         return -1;
 
+    tx = &client->tx;
     for (;;)
     {
-        /* Check for empty tx buffer */
-        if (client->tx.pos == client->tx.size)
-        {
-            client->tx.pos = 0;
-            client->tx.size = 0;
+        /* Check for empty tx queue */
+        if (!tx->size)
             return 0;
+
+        /* Gather the queued frames */
+        iovCount = 0;
+        for (uint32_t i = 0; i < tx->count && iovCount < TX_IOV_MAX; ++i)
+        {
+            slot = &tx->slots[(tx->head + i) & (tx->capacity - 1)];
+            if (slot->frame->size == slot->pos)
+                continue;
+            iov[iovCount].iov_base = slot->frame->data + slot->pos;
+            iov[iovCount].iov_len = slot->frame->size - slot->pos;
+            iovCount++;
         }
 
         /* Send */
-        ret = send(client->socket, client->tx.data + client->tx.pos, client->tx.size - client->tx.pos, 0);
+        ret = writev(client->socket, iov, iovCount);
         if (ret >= 0)
         {
-            client->tx.pos += ret;
+            txConsume(tx, &app->framePool, ret);
         }
         else
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+#if defined(MULTI_IO_URING)
+                multiUringWantOutput(app, client);
+#endif
                 return 0;
+            }
             fprintf(stderr, "Client #%d: Write error %d\n", client->id, errno);
             multiClientRemove(app, client);
             return -1;
         }
     }
 }
+
+/**
+ * Queue a client to be flushed at the end of the loop iteration, so that
+ * everything queued on it meanwhile goes out in one writev.
+ */
+void multiClientFlushLater(App* app, Client* client)
+{
+    if (!client->valid || client->txQueued)
+        return;
+
+    if (app->txDirtySize == app->txDirtyCapacity)
+    {
+        app->txDirtyCapacity = app->txDirtyCapacity ? app->txDirtyCapacity * 2 : 64;
+        app->txDirty = realloc(app->txDirty, sizeof(int) * app->txDirtyCapacity);
+    }
+    app->txDirty[app->txDirtySize++] = client->id;
+    client->txQueued = 1;
+}
+
+/**
+ * Flush every client queued by multiClientFlushLater.
+ */
+void multiClientFlushDirty(App* app)
+{
+    Client* client;
+
+    /* Flushing may remove clients and queue others, the size is read again */
+    for (int i = 0; i < app->txDirtySize; ++i)
+    {
+        client = APP_CLIENT(app, app->txDirty[i]);
+        if (!client->txQueued)
+            continue;
+        client->txQueued = 0;
+        multiClientFlushOut(app, client);
+    }
+    app->txDirtySize = 0;
+}
@@ -0,0 +1,77 @@
+#include "multi.h"
+
+/**
+ * Allocate an empty frame that can hold up to capacity bytes.
+ * The caller owns the only reference.
+ */
+Frame* frameNew(uint32_t capacity)
+{
+    Frame* frame;
+
+    frame = malloc(sizeof(*frame) + capacity);
+    if (!frame)
+        return NULL;
+    frame->refCount = 1;
+    frame->shared = 0;
+    frame->size = 0;
+    frame->capacity = capacity;
+
+    return frame;
+}
+
+Frame* frameRef(Frame* frame)
+{
+    frame->refCount++;
+    return frame;
+}
+
+void frameUnref(Frame* frame)
+{
+    if (--frame->refCount == 0)
+        free(frame);
+}
+
+void framePoolInit(FramePool* pool)
+{
+    pool->chunks = malloc(sizeof(Frame*) * FRAME_POOL_MAX);
+    pool->size = 0;
+}
+
+void framePoolFree(FramePool* pool)
+{
+    for (uint32_t i = 0; i < pool->size; ++i)
+        free(pool->chunks[i]);
+    free(pool->chunks);
+    pool->chunks = NULL;
+    pool->size = 0;
+}
+
+/**
+ * Get an empty private frame of TX_CHUNK_SIZE bytes, recycled if possible.
+ */
+Frame* framePoolGet(FramePool* pool)
+{
+    Frame* frame;
+
+    if (!pool->size)
+        return frameNew(TX_CHUNK_SIZE);
+
+    frame = pool->chunks[--pool->size];
+    frame->refCount = 1;
+    frame->shared = 0;
+    frame->size = 0;
+    return frame;
+}
+
+/**
+ * Drop a reference to a frame, recycling private chunks into the pool.
+ */
+void framePoolPut(FramePool* pool, Frame* frame)
+{
+    if (--frame->refCount)
+        return;
+    if (!frame->shared && frame->capacity == TX_CHUNK_SIZE && pool->size < FRAME_POOL_MAX)
+        pool->chunks[pool->size++] = frame;
+    else
+        free(frame);
+}
@@ -1,6 +1,81 @@
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 #include "multi.h"
 
-static uint32_t hsHash(uint64_t value)
+/**
+ * A Swiss table of 64-bit values.
+ * Slots come in groups of HS_GROUP_SLOTS sharing one cache line, the
+ * control bytes first and the values after them. A control byte is either
+ * HS_EMPTY or the low 7 bits of the value hash. Lookups compare the
+ * control bytes of a whole group at once and only look at the values
+ * whose control byte matches, so every value, including 0, can be stored.
+ * The last control byte of a group is a bitmap of the hashes that moved
+ * past it while it was full, a lookup stops at the first group whose bit
+ * is clear. Values are never removed, so no tombstones are needed and the
+ * table can run up to 7/8 full.
+ */
+
+#define HS_EMPTY        0x80
+#define HS_GROUP_SLOTS  7
+#define HS_MIN_GROUPS   4
+
+/* Bits 7 and up pick the group, the top ones are free */
+#define HS_OVERFLOW_BIT(h)  (1 << ((h) >> 61))
+
+typedef struct HsGroup
+{
+    uint8_t     ctrl[HS_GROUP_SLOTS];
+    uint8_t     overflow;
+    uint64_t    values[HS_GROUP_SLOTS];
+}
+HsGroup;
+
+#if defined(__SSE2__)
+typedef uint32_t HsMask;
+
+static HsMask hsMatch(const HsGroup* g, uint8_t h2)
+{
+    __m128i ctrl;
+
+    ctrl = _mm_loadl_epi64((const __m128i*)g);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)h2))) & 0x7f;
+}
+
+static HsMask hsMatchEmpty(const HsGroup* g)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_loadl_epi64((const __m128i*)g)) & 0x7f;
+}
+
+# define HS_MASK_INDEX(m)   ((uint32_t)__builtin_ctz(m))
+#else
+/* Portable fallback, one bit per slot in the high bit of its byte.
+ * The control bytes and the overflow byte are loaded as one word */
+typedef uint64_t HsMask;
+
+static HsMask hsMatch(const HsGroup* g, uint8_t h2)
+{
+    uint64_t ctrl;
+
+    /* May report a false match right after a true one, on a full slot,
+     * the values are compared anyway */
+    memcpy(&ctrl, g, 8);
+    ctrl ^= 0x0101010101010101ULL * h2;
+    return (ctrl - 0x0101010101010101ULL) & ~ctrl & 0x0080808080808080ULL;
+}
+
+static HsMask hsMatchEmpty(const HsGroup* g)
+{
+    uint64_t ctrl;
+
+    memcpy(&ctrl, g, 8);
+    return ctrl & 0x0080808080808080ULL;
+}
+
+# define HS_MASK_INDEX(m)   ((uint32_t)__builtin_ctzll(m) / 8)
+#endif
+
+uint32_t hashset64Hash(uint64_t value)
 {
     uint32_t tmp;
 
@@ -12,81 +87,162 @@ static uint32_t hsHash(uint64_t value)
     return tmp;
 }
 
-static void hsInsert(uint64_t* table, uint32_t tableSize, uint64_t value)
+/**
+ * Hash a value over 64 bits by folding a full multiply, the low 7 bits go
+ * to the control byte and the next ones pick the first group.
+ */
+static uint64_t hsHash(uint64_t value)
 {
-    uint32_t h;
-    uint32_t bucket;
+    unsigned __int128 r;
 
-    h = hsHash(value);
-    bucket = h & (tableSize - 1);
+    r = (unsigned __int128)value * 0x9e3779b97f4a7c15ULL;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint32_t hsGrowth(uint32_t capacity)
+{
+    return capacity - capacity / 8;
+}
+
+static void hsAlloc(HashSet64* set, uint32_t groupCount)
+{
+    HsGroup* groups;
+
+    groups = aligned_alloc(64, sizeof(HsGroup) * (size_t)groupCount);
+    for (uint32_t i = 0; i < groupCount; ++i)
+    {
+        memset(groups[i].ctrl, HS_EMPTY, sizeof(groups[i].ctrl));
+        groups[i].overflow = 0;
+    }
+    set->groups = groups;
+    set->groupCount = groupCount;
+    set->capacity = groupCount * HS_GROUP_SLOTS;
+}
+
+/**
+ * Store a value in the first group with an empty slot on its probe sequence.
+ */
+static void hsInsert(HashSet64* set, uint64_t value, uint64_t h)
+{
+    HsGroup* g;
+    uint32_t mask;
+    uint32_t pos;
+    uint32_t stride;
+    HsMask m;
+
+    mask = set->groupCount - 1;
+    pos = (uint32_t)(h >> 7) & mask;
+    stride = 0;
     for (;;)
     {
-        if (table[bucket] == 0)
+        g = set->groups + pos;
+        m = hsMatchEmpty(g);
+        if (m)
         {
-            table[bucket] = value;
+            g->ctrl[HS_MASK_INDEX(m)] = h & 0x7f;
+            g->values[HS_MASK_INDEX(m)] = value;
             return;
         }
-        bucket = (bucket + 1) & (tableSize - 1);
+        g->overflow |= HS_OVERFLOW_BIT(h);
+        stride++;
+        pos = (pos + stride) & mask;
     }
 }
 
-static void hsRehash(HashSet64* set)
+static void hsRehash(HashSet64* set, uint32_t newGroupCount)
 {
-    uint64_t* newData;
-    uint32_t newCapacity;
+    HsGroup* oldGroups;
+    uint32_t oldGroupCount;
+    HsGroup* g;
 
-    newCapacity = set->capacity * 2;
-    newData = malloc(sizeof(uint64_t) * newCapacity);
-    memset(newData, 0, sizeof(uint64_t) * newCapacity);
+    oldGroups = set->groups;
+    oldGroupCount = set->groupCount;
+    hsAlloc(set, newGroupCount);
 
-    for (uint32_t i = 0; i < set->capacity; ++i)
+    /* Values are unique, they go straight to the first empty slot */
+    for (uint32_t i = 0; i < oldGroupCount; ++i)
     {
-        if (set->data[i] != 0)
-            hsInsert(newData, newCapacity, set->data[i]);
+        g = oldGroups + i;
+        for (uint32_t j = 0; j < HS_GROUP_SLOTS; ++j)
+        {
+            if (!(g->ctrl[j] & HS_EMPTY))
+                hsInsert(set, g->values[j], hsHash(g->values[j]));
+        }
     }
 
-    free(set->data);
-    set->data = newData;
-    set->capacity = newCapacity;
+    free(oldGroups);
 }
 
 void hashset64Init(HashSet64* set)
 {
     set->size = 0;
-    set->capacity = 32;
-    set->data = malloc(sizeof(uint64_t) * set->capacity);
-    memset(set->data, 0, sizeof(uint64_t) * set->capacity);
+    hsAlloc(set, HS_MIN_GROUPS);
 }
 
 void hashset64Free(HashSet64* set)
 {
-    free(set->data);
+    free(set->groups);
 }
 
-void hashset64Add(HashSet64* set, uint64_t value)
+/**
+ * Grow the set ahead of time so that it holds count values without
+ * rehashing.
+ */
+void hashset64Reserve(HashSet64* set, uint32_t count)
 {
-    if (set->size * 2 > set->capacity)
-        hsRehash(set);
+    uint32_t newGroupCount;
 
-    hsInsert(set->data, set->capacity, value);
-    set->size++;
+    newGroupCount = set->groupCount;
+    while (count > hsGrowth(newGroupCount * HS_GROUP_SLOTS))
+        newGroupCount *= 2;
+    if (newGroupCount != set->groupCount)
+        hsRehash(set, newGroupCount);
 }
 
-int hashset64Contains(HashSet64* set, uint64_t value)
+static int hsContains(const HashSet64* set, uint64_t value, uint64_t h)
 {
-    uint32_t h;
-    uint32_t bucket;
-    uint64_t tmp;
+    const HsGroup* g;
+    uint32_t mask;
+    uint32_t pos;
+    uint32_t stride;
+    HsMask m;
 
-    h = hsHash(value);
-    bucket = h & (set->capacity - 1);
+    mask = set->groupCount - 1;
+    pos = (uint32_t)(h >> 7) & mask;
+    stride = 0;
     for (;;)
     {
-        tmp = set->data[bucket];
-        if (tmp == 0)
+        g = set->groups + pos;
+        for (m = hsMatch(g, h & 0x7f); m; m &= m - 1)
+        {
+            if (g->values[HS_MASK_INDEX(m)] == value)
+                return 1;
+        }
+
+        /* No value with that hash moved past this group */
+        if (!(g->overflow & HS_OVERFLOW_BIT(h)))
             return 0;
-        if (tmp == value)
-            return 1;
-        bucket = (bucket + 1) & (set->capacity - 1);
+        stride++;
+        pos = (pos + stride) & mask;
     }
 }
+
+void hashset64Add(HashSet64* set, uint64_t value)
+{
+    uint64_t h;
+
+    h = hsHash(value);
+    if (hsContains(set, value, h))
+        return;
+
+    if (set->size >= hsGrowth(set->capacity))
+        hsRehash(set, set->groupCount * 2);
+
+    hsInsert(set, value, h);
+    set->size++;
+}
+
+int hashset64Contains(HashSet64* set, uint64_t value)
+{
+    return hsContains(set, value, hsHash(value));
+}
@@ -2,23 +2,128 @@
 #include <netinet/tcp.h>
 #include "multi.h"
 
+/**
+ * Init the state owned by a single worker.
+ */
+static void initWorker(App* app)
+{
+    app->epoll = epoll_create1(0);
+    app->timer = -1;
+    app->clientFree = -1;
+
+    app->migrated = 0;
+    app->handoffEvent = -1;
+    pthread_mutex_init(&app->handoffLock, NULL);
+    app->handoffQueue = NULL;
+    app->handoffSize = 0;
+    app->handoffCapacity = 0;
+    app->statsGeneration = 0;
+    app->handoffRetry = NULL;
+    app->handoffRetrySize = 0;
+    app->handoffRetryCapacity = 0;
+    app->handoffRetryDeadline = 0;
+
+    app->ledgerSize = 0;
+    app->ledgerCapacity = 4;
+    app->ledgers = malloc(sizeof(Ledger) * app->ledgerCapacity);
+    app->ledgerFree = -1;
+    app->ledgerCount = 0;
+    app->ledgerTableCapacity = 16;
+    app->ledgerTable = malloc(sizeof(int) * app->ledgerTableCapacity);
+    memset(app->ledgerTable, 0xff, sizeof(int) * app->ledgerTableCapacity);
+    app->idleHead = -1;
+    app->idleTail = -1;
+    app->idleCount = 0;
+    app->idleSize = 0;
+
+    app->syncDeadline = 0;
+    app->syncSize = 0;
+    app->syncCapacity = 4;
+    app->syncQueue = malloc(sizeof(int) * app->syncCapacity);
+    app->loadSize = 0;
+    app->loadCapacity = 0;
+    app->loadQueue = NULL;
+    app->txDirtySize = 0;
+    app->txDirtyCapacity = 0;
+    app->txDirty = NULL;
+
+    app->uring = NULL;
+    app->uringFile = NULL;
+
+    app->persist = NULL;
+    app->persistEvent = -1;
+    app->persistDoneEvent = -1;
+
+    framePoolInit(&app->framePool);
+    multiTimerInit(app);
+    memset(&app->stats, 0, sizeof(app->stats));
+}
+
+static void quitWorker(App* app)
+{
+    /* Close ledgers, their close jobs run on the persistence thread */
+    for (int i = 0; i < app->ledgerSize; ++i)
+    {
+        if (app->ledgers[i].valid)
+            multiLedgerClose(app, i);
+    }
+
+    /* Make everything durable */
+    multiPersistStop(app);
+
+    /* Close epoll */
+#if defined(MULTI_IO_URING)
+    multiUringQuit(app);
+#endif
+    close(app->epoll);
+    if (app->timer != -1)
+        close(app->timer);
+    if (app->handoffEvent != -1)
+        close(app->handoffEvent);
+
+    pthread_mutex_destroy(&app->handoffLock);
+    free(app->handoffQueue);
+    free(app->handoffRetry);
+    free(app->syncQueue);
+    free(app->loadQueue);
+    free(app->txDirty);
+    free(app->ledgers);
+    free(app->ledgerTable);
+    framePoolFree(&app->framePool);
+}
+
 int multiInit(App* app, const char* dataDir)
 {
     char buf[512];
 
     /* Init app */
-    app->epoll = epoll_create1(0);
     app->socket = -1;
-    app->timer = -1;
     app->dataDir = dataDir;
 
-    app->clientSize = 0;
-    app->clientCapacity = 8;
-    app->clients = malloc(sizeof(Client) * app->clientCapacity);
+    app->clients = malloc(sizeof(ClientPool));
+    pthread_mutex_init(&app->clients->lock, NULL);
+    app->clients->size = 0;
+    app->clients->stride = 1;
+    memset(app->clients->chunks, 0, sizeof(app->clients->chunks));
 
-    app->ledgerSize = 0;
-    app->ledgerCapacity = 4;
-    app->ledgers = malloc(sizeof(Ledger) * app->ledgerCapacity);
+    app->workerId = 0;
+    app->workerCount = 1;
+    app->workers = NULL;
+
+    app->processId = 0;
+    app->processCount = 1;
+    app->processInbox = -1;
+    app->processPeers = NULL;
+    app->processPids = NULL;
+
+    app->syncWindow = 0;
+    app->cacheMax = 256 * 1024;
+    app->retainMax = 64 * 1024 * 1024;
+    app->retainTtl = 300;
+    app->keepalive = 3;
+    app->timeout = 30;
+
+    initWorker(app);
 
     /* Init dirs */
     snprintf(buf, 512, "%s/ledgers", dataDir);
@@ -28,35 +133,66 @@ int multiInit(App* app, const char* dataDir)
     return 0;
 }
 
+/**
+ * Init an extra worker sharing the configuration and clients of app.
+ */
+int multiInitWorker(App* worker, const App* app, int workerId)
+{
+    memcpy(worker, app, sizeof(*worker));
+    worker->workerId = workerId;
+    initWorker(worker);
+
+    return 0;
+}
+
 int multiQuit(App* app)
 {
-    /* Close master socket */
+    App* owner;
+    Client* c;
+
+    /* Close master socket, shut down first as in-flight io_uring accepts
+     * keep a reference to it */
     if (app->socket != -1)
+    {
+        shutdown(app->socket, SHUT_RDWR);
         close(app->socket);
+    }
 
-    /* Close client sockets */
-    for (int i = 0; i < app->clientSize; ++i)
+    /* Close client sockets, handed off IDs may be anywhere in the pool */
+    for (int i = 0; i < CLIENT_MAX; ++i)
     {
-        if (app->clients[i].valid)
-            multiClientDisconnect(app, &app->clients[i]);
+        if (!app->clients->chunks[i / CLIENT_CHUNK_SIZE])
+        {
+            i += CLIENT_CHUNK_SIZE - 1;
+            continue;
+        }
+        c = APP_CLIENT(app, i);
+        if (!c->valid)
+            continue;
+        owner = app->workers ? app->workers[c->worker] : app;
+        multiClientDisconnect(owner, c);
     }
 
-    /* Close ledgers (just in case) */
-    for (int i = 0; i < app->ledgerSize; ++i)
+    /* Stop the workers */
+    for (int i = 1; i < app->workerCount && app->workers; ++i)
     {
-        if (app->ledgers[i].valid)
-            multiLedgerClose(app, i);
+        quitWorker(app->workers[i]);
+        free(app->workers[i]);
     }
+    quitWorker(app);
+    free(app->workers);
+    multiProcessQuit(app);
 
-    /* Close epoll */
-    close(app->epoll);
+    for (int i = 0; i < CLIENT_CHUNK_COUNT; ++i)
+        free(app->clients->chunks[i]);
+    pthread_mutex_destroy(&app->clients->lock);
+    free(app->clients);
 
     return 0;
 }
 
 int multiListen(App* app, const char* host, uint16_t port)
 {
-    struct epoll_event event;
     struct addrinfo hints;
     struct addrinfo* result;
     struct addrinfo* ptr;
@@ -103,6 +239,20 @@ int multiListen(App* app, const char* host, uint16_t port)
             continue;
         }
 
+        /* Set SO_REUSEPORT, every process binds its own socket */
+        if (app->processCount > 1)
+        {
+            ret = 1;
+            ret = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &ret, sizeof(ret));
+            if (ret == -1)
+            {
+                perror("setsockopt");
+                close(s);
+                s = -1;
+                continue;
+            }
+        }
+
         /* Set TCP_NODELAY */
         ret = 1;
         setsockopt(s, SOL_TCP, TCP_NODELAY, &ret, sizeof(ret));
@@ -138,17 +288,6 @@ int multiListen(App* app, const char* host, uint16_t port)
     /* Make the socket non-blocking */
     ret = fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
 
-    /* Add the socket to the epoll */
-    event.events = EPOLLIN;
-    event.data.u32 = APP_EP_SOCK_SERVER;
-    ret = epoll_ctl(app->epoll, EPOLL_CTL_ADD, s, &event);
-    if (ret == -1)
-    {
-        perror("epoll_ctl");
-        close(s);
-        return -1;
-    }
-
     /* Save the socket */
     app->socket = s;
     fprintf(stderr, "Listening on %s:%d\n", host, port);
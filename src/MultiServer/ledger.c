@@ -1,4 +1,6 @@
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
 #include "multi.h"
 
 static int paddingSize(int size)
@@ -6,204 +8,1981 @@ static int paddingSize(int size)
     return (16 - (size % 16)) % 16;
 }
 
-static void ledgerSetIndex(Ledger* l, uint32_t entryId, uint32_t idx)
+static uint64_t ledgerOffset(const Ledger* l, uint32_t entryId)
 {
-    while (l->indexCapacity <= entryId)
+    return l->indexPages[entryId / LEDGER_INDEX_PAGE][entryId % LEDGER_INDEX_PAGE];
+}
+
+/**
+ * Make room in the page table for count entries.
+ * Only the table of page pointers is ever reallocated.
+ */
+static void ledgerIndexPages(Ledger* l, uint32_t count)
+{
+    uint32_t pageCount;
+
+    pageCount = (uint32_t)(((uint64_t)count + LEDGER_INDEX_PAGE - 1) / LEDGER_INDEX_PAGE);
+    if (pageCount <= l->indexPageCapacity)
+        return;
+    while (l->indexPageCapacity < pageCount)
+        l->indexPageCapacity = l->indexPageCapacity ? l->indexPageCapacity * 2 : 16;
+    l->indexPages = realloc(l->indexPages, sizeof(uint64_t*) * l->indexPageCapacity);
+}
+
+/**
+ * Set the offset of an entry, appended right after the last one.
+ */
+static void ledgerSetIndex(Ledger* l, uint32_t entryId, uint64_t offset)
+{
+    if (entryId / LEDGER_INDEX_PAGE == l->indexPageCount)
+    {
+        ledgerIndexPages(l, entryId + 1);
+        l->indexPages[l->indexPageCount++] = malloc(sizeof(uint64_t) * LEDGER_INDEX_PAGE);
+    }
+    l->indexPages[entryId / LEDGER_INDEX_PAGE][entryId % LEDGER_INDEX_PAGE] = offset;
+}
+
+static void ledgerIndexFree(Ledger* l)
+{
+    for (uint32_t i = 0; i < l->indexPageCount; ++i)
+        free(l->indexPages[i]);
+    free(l->indexPages);
+    l->indexPages = NULL;
+    l->indexPageCount = 0;
+    l->indexPageCapacity = 0;
+}
+
+/**
+ * Grow the index and key set ahead of time for count entries.
+ * Only the keys of the head entries go to the key set.
+ */
+static void ledgerReserve(Ledger* l, uint32_t count)
+{
+    ledgerIndexPages(l, count);
+    hashset64Reserve(&l->keysSet, count - l->sealedCount);
+}
+
+/**
+ * Get the memory held by a ledger, as counted against the retention budget.
+ */
+static uint64_t ledgerIdleSize(const Ledger* l)
+{
+    return sizeof(uint64_t) * LEDGER_INDEX_PAGE * (uint64_t)(l->indexPageCount - l->sealedCount / LEDGER_INDEX_PAGE) + 64 * (uint64_t)l->keysSet.groupCount + l->cacheCapacity + l->pendingCapacity + l->spareCapacity + l->lz4Size;
+}
+
+/**
+ * Count an idle ledger again after its buffers changed, a batch or a load
+ * step may complete once its last client is gone.
+ */
+static void ledgerIdleResize(App* app, Ledger* l)
+{
+    if (!l->idle)
+        return;
+    app->idleSize -= l->idleSize;
+    l->idleSize = ledgerIdleSize(l);
+    app->idleSize += l->idleSize;
+}
+
+/**
+ * Grow the read mapping so that it covers every byte written to the data file.
+ * Ledgers without a mapping are read with pread instead.
+ */
+static void ledgerMap(Ledger* l)
+{
+    void* map;
+    size_t written;
+    size_t mapSize;
+
+    written = l->size - l->pendingSize - l->flushSize;
+    if (written <= l->mapSize)
+        return;
+
+    /* Reserve room ahead so appends rarely need a new mapping */
+    mapSize = l->mapSize ? l->mapSize : LEDGER_MAP_MIN;
+    while (mapSize < written)
+        mapSize *= 2;
+
+    if (l->map)
+        munmap((void*)l->map, l->mapSize);
+    map = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, l->fileData, 0);
+    if (map == MAP_FAILED)
+    {
+        l->map = NULL;
+        l->mapSize = 0;
+        return;
+    }
+    l->map = map;
+    l->mapSize = mapSize;
+}
+
+/**
+ * Append bytes written to the data file to the tail cache, evicting the
+ * oldest half of the cache when it would grow past the configured cap.
+ */
+static void ledgerCacheAppend(App* app, Ledger* l, const char* data, uint32_t size)
+{
+    uint32_t cap;
+    uint32_t drop;
+    uint32_t newCapacity;
+
+    cap = app->cacheMax;
+    if (!cap)
+        return;
+
+    /* Only the most recent bytes can fit */
+    if (size > cap)
+    {
+        l->cacheBase += l->cacheSize + (size - cap);
+        l->cacheSize = 0;
+        data += size - cap;
+        size = cap;
+    }
+
+    /* Evict */
+    if (l->cacheSize + size > cap)
+    {
+        drop = l->cacheSize + size - cap / 2;
+        if (drop > l->cacheSize)
+            drop = l->cacheSize;
+        memmove(l->cache, l->cache + drop, l->cacheSize - drop);
+        l->cacheBase += drop;
+        l->cacheSize -= drop;
+    }
+
+    /* Grow */
+    if (l->cacheSize + size > l->cacheCapacity)
+    {
+        newCapacity = l->cacheCapacity ? l->cacheCapacity : 4096;
+        while (newCapacity < l->cacheSize + size)
+            newCapacity *= 2;
+        if (newCapacity > cap)
+            newCapacity = cap;
+        l->cache = realloc(l->cache, newCapacity);
+        l->cacheCapacity = newCapacity;
+    }
+
+    memcpy(l->cache + l->cacheSize, data, size);
+    l->cacheSize += size;
+}
+
+/**
+ * Fill the tail cache of a freshly loaded ledger.
+ */
+static void ledgerCacheLoad(App* app, Ledger* l)
+{
+    uint32_t size;
+
+    size = l->size > app->cacheMax ? app->cacheMax : (uint32_t)l->size;
+    if (!size)
+        return;
+
+    l->cacheBase = l->size - size;
+    l->cache = malloc(size);
+    l->cacheCapacity = size;
+    l->cacheSize = size;
+    if (l->map)
+        memcpy(l->cache, l->map + l->cacheBase, size);
+    else
+        multiFilePread(l->fileData, l->cache, l->cacheBase, size);
+}
+
+/**
+ * Write the index records of a run of entries, the first one being record
+ * first at head data file offset offset.
+ * Called by the persistence thread as well, so only the arguments are used.
+ * @return 0 on success, -1 on error
+ */
+int multiLedgerIndexAppend(int fd, uint32_t first, const char* data, uint64_t size, uint64_t offset)
+{
+    LedgerIndexRecord records[256];
+    const LedgerEntryHeader* header;
+    uint64_t off;
+    uint32_t count;
+    uint32_t entrySize;
+
+    off = 0;
+    while (off < size)
+    {
+        count = 0;
+        while (off < size && count < sizeof(records) / sizeof(*records))
+        {
+            header = (const LedgerEntryHeader*)(data + off);
+            records[count].key = header->key;
+            records[count].offset = offset + off;
+            entrySize = sizeof(*header) + header->size;
+            off += entrySize + paddingSize(entrySize);
+            count++;
+        }
+
+        if (pwrite(fd, records, sizeof(*records) * count, sizeof(LedgerIndexHeader) + (off_t)sizeof(*records) * first) != (ssize_t)(sizeof(*records) * count))
+            return -1;
+        first += count;
+    }
+
+    return 0;
+}
+
+/**
+ * Mark the first count index records as trusted.
+ * The records are made durable before the header points past them.
+ * @return 0 on success, -1 on error
+ */
+int multiLedgerIndexCheckpoint(int fd, uint32_t base, uint32_t count, uint64_t size)
+{
+    LedgerIndexHeader header;
+
+    if (fdatasync(fd))
+        return -1;
+
+    memcpy(header.magic, LEDGER_INDEX_MAGIC, sizeof(header.magic));
+    header.base = base;
+    header.count = count;
+    header.size = size;
+    if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Validate the index file and load its checkpointed offsets.
+ * The records are kept so that the load steps add their keys to the set.
+ * @return 0 on success, -1 if the index is missing or does not match the data
+ */
+static int ledgerLoadIndex(Ledger* l, LedgerLoad* load)
+{
+    LedgerIndexHeader header;
+    LedgerIndexRecord* records;
+    LedgerEntryHeader entry;
+    uint32_t entrySize;
+    uint64_t last;
+
+    if (multiFilePread(l->fileIndex, &header, 0, sizeof(header)) || memcmp(header.magic, LEDGER_INDEX_MAGIC, sizeof(header.magic)) || header.base != l->sealedCount)
+        return -1;
+    if (!header.count)
+        return header.size ? -1 : 0;
+
+    /* The data file may be longer, never shorter */
+    if (header.size > load->totalSize || header.count > header.size / 16)
+        return -1;
+
+    records = malloc(sizeof(*records) * (size_t)header.count);
+    if (!records)
+        return -1;
+    if (multiFilePread(l->fileIndex, records, sizeof(header), sizeof(*records) * (size_t)header.count))
+    {
+        free(records);
+        return -1;
+    }
+
+    /* Offsets must be increasing, and the last entry must end at the checkpoint */
+    for (uint32_t i = 0; i < header.count; ++i)
+    {
+        if (i ? records[i].offset <= records[i - 1].offset : records[i].offset != 0)
+        {
+            free(records);
+            return -1;
+        }
+    }
+    last = records[header.count - 1].offset;
+    if (multiFilePread(l->fileData, &entry, last, sizeof(entry)) || entry.key != records[header.count - 1].key)
+    {
+        free(records);
+        return -1;
+    }
+    entrySize = sizeof(entry) + entry.size;
+    entrySize += paddingSize(entrySize);
+    if (last + entrySize != header.size)
     {
-        l->indexCapacity *= 2;
-        l->index = realloc(l->index, sizeof(uint32_t) * l->indexCapacity);
+        free(records);
+        return -1;
     }
-    l->index[entryId] = idx;
+
+    /* Load the offsets */
+    ledgerReserve(l, header.base + header.count);
+    for (uint32_t i = 0; i < header.count; ++i)
+        ledgerSetIndex(l, header.base + i, records[i].offset);
+    l->count = header.base + header.count;
+    l->size = header.size;
+    load->records = records;
+    load->recordCount = header.count;
+    load->recordPos = 0;
+
+    return 0;
 }
 
-static void ledgerLoadData(Ledger* l)
+/**
+ * Scan one block of the data file past the index checkpoint, parsing the
+ * headers from memory.
+ * @return 0 on success, -1 on read error
+ */
+static int ledgerLoadScan(Ledger* l, LedgerLoad* load, int id)
 {
-    uint32_t totalSize;
     uint32_t entrySize;
+    uint64_t readSize;
+    uint32_t avail;
     LedgerEntryHeader header;
 
-    /* Get the total size */
-    totalSize = lseek(l->fileData, 0, SEEK_END);
-    lseek(l->fileData, 0, SEEK_SET);
+    if (!load->block)
+    {
+        load->block = malloc(LEDGER_LOAD_BLOCK);
+        if (!load->block)
+            return 0;
+    }
+
+    /* Presize from the entries seen so far once the first block is parsed */
+    if (!load->presized && l->size > load->scanBase)
+    {
+        ledgerReserve(l, l->count + (uint32_t)((load->totalSize - l->size) * (l->count - load->scanCount) / (l->size - load->scanBase)) + 1);
+        load->presized = 1;
+    }
+
+    /* Refill, keeping the entry that crosses the end of the previous block */
+    avail = load->blockSize - load->blockOff;
+    memmove(load->block, load->block + load->blockOff, avail);
+    load->blockSize = avail;
+    load->blockOff = 0;
+    readSize = load->totalSize - l->size - avail;
+    if (readSize > LEDGER_LOAD_BLOCK - avail)
+        readSize = LEDGER_LOAD_BLOCK - avail;
+    if (!readSize)
+    {
+        /* Drop an entry torn by a crash, appends must land right after the last one */
+        fprintf(stderr, "Ledger #%d: Dropping %llu bytes of torn data\n", id, (unsigned long long)(load->totalSize - l->size));
+        if (ftruncate(l->fileData, l->size))
+            perror("ftruncate");
+        load->totalSize = l->size;
+        return 0;
+    }
+
+    /* The entries past the error may be durable, the file is left alone */
+    if (multiFilePread(l->fileData, load->block + avail, l->size + avail, readSize))
+    {
+        fprintf(stderr, "Ledger #%d: Read error at %llu\n", id, (unsigned long long)(l->size + avail));
+        return -1;
+    }
+    load->blockSize += (uint32_t)readSize;
 
     for (;;)
     {
-        /* Check if we're done */
-        if (l->size == totalSize)
+        /* Parse the next header */
+        avail = load->blockSize - load->blockOff;
+        if (avail < sizeof(header))
+            break;
+        memcpy(&header, load->block + load->blockOff, sizeof(header));
+        entrySize = sizeof(header) + header.size;
+        entrySize += paddingSize(entrySize);
+        if (entrySize > avail)
             break;
-
-        /* Read the header */
-        multiFilePread(l->fileData, &header, l->size, sizeof(header));
 
         /* Record the key and index */
         hashset64Add(&l->keysSet, header.key);
         ledgerSetIndex(l, l->count, l->size);
 
         /* Skip the entry */
-        entrySize = sizeof(header) + header.size;
-        entrySize += paddingSize(entrySize);
+        load->blockOff += entrySize;
         l->size += entrySize;
         l->count++;
     }
+
+    return 0;
 }
 
-static void makeLedger(App* app, const char* uuid, int id)
+/**
+ * Add the entries found by scanning the data file to the index, so the
+ * next open does not scan them again.
+ */
+static void ledgerIndexTail(Ledger* l)
 {
-    Ledger* l;
-    const uint8_t* u;
-    char buf[520];
-    char bufBase[512];
+    const char* data;
+    char* buf;
+    uint64_t offset;
+    uint64_t size;
 
-    l = app->ledgers + id;
-    u = (const uint8_t*)uuid;
+    if (l->fileIndex == -1 || l->indexCheckpoint == l->count)
+        return;
 
-    /* Init the ledger */
-    l->valid = 1;
-    memcpy(l->uuid, uuid, 16);
-    l->refCount = 0;
-    l->indexCapacity = 512;
-    l->index = malloc(sizeof(uint32_t) * l->indexCapacity);
-    hashset64Init(&l->keysSet);
+    offset = ledgerOffset(l, l->indexCheckpoint);
+    size = l->size - offset;
+    buf = NULL;
+    if (l->map)
+        data = l->map + offset;
+    else
+    {
+        buf = malloc(size);
+        if (!buf || multiFilePread(l->fileData, buf, offset, size))
+        {
+            free(buf);
+            return;
+        }
+        data = buf;
+    }
 
-    /* Open ledger files */
-    snprintf(bufBase, sizeof(bufBase), "%s/ledgers/%02x", app->dataDir, u[0]);
-    mkdir(bufBase, 0755);
-    snprintf(bufBase, sizeof(bufBase), "%s/ledgers/%02x/%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x", app->dataDir, u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
-    mkdir(bufBase, 0755);
-    snprintf(buf, sizeof(buf), "%s/data", bufBase);
-    l->fileData = open(buf, O_APPEND | O_RDWR | O_CREAT, 0644);
-    l->count = 0;
-    l->size = 0;
+    if (!multiLedgerIndexAppend(l->fileIndex, l->indexCheckpoint - l->sealedCount, data, size, offset) && !multiLedgerIndexCheckpoint(l->fileIndex, l->sealedCount, l->count - l->sealedCount, l->size))
+        l->indexCheckpoint = l->count;
+    free(buf);
+}
 
-    /* Load ledger data */
-    ledgerLoadData(l);
+/**
+ * Take a ledger off the load queue, keeping the order of the others.
+ */
+static void ledgerLoadDequeue(App* app, int id)
+{
+    for (int i = 0; i < app->loadSize; ++i)
+    {
+        if (app->loadQueue[i] == id)
+        {
+            memmove(app->loadQueue + i, app->loadQueue + i + 1, sizeof(int) * (app->loadSize - i - 1));
+            app->loadSize--;
+            return;
+        }
+    }
+}
 
-    /* Log */
-    fprintf(stderr, "Ledger #%d: Loaded (entries: %d, bytes: %d)\n", id, l->count, l->size);
+/**
+ * Stop loading a ledger, along with the writes it held back.
+ */
+static void ledgerLoadAbort(App* app, int id)
+{
+    Ledger* l;
+    LedgerLoad* load;
+
+    l = app->ledgers + id;
+    load = l->load;
+    l->load = NULL;
+    ledgerLoadDequeue(app, id);
+    free(load->records);
+    free(load->block);
+    free(load->held);
+    free(load);
 }
 
-int multiLedgerOpen(App* app, const char* uuid)
+/**
+ * Finish loading a ledger: build the tail cache, catch up the index file
+ * and replay the writes held back meanwhile.
+ */
+static void ledgerLoadFinish(App* app, int id)
 {
     Ledger* l;
-    int id;
+    LedgerLoad* load;
+    Client* c;
+    const LedgerEntryHeader* header;
 
-    /* Find a previous ledger */
-    for (int i = 0; i < app->ledgerSize; ++i)
+    l = app->ledgers + id;
+    load = l->load;
+    l->load = NULL;
+    ledgerLoadDequeue(app, id);
+    l->durableCount = l->count;
+    ledgerMap(l);
+    ledgerIndexTail(l);
+    ledgerCacheLoad(app, l);
+    free(load->records);
+    free(load->block);
+
+    /* Log */
+    fprintf(stderr, "Ledger #%d: Loaded (entries: %u, segments: %u, bytes: %llu)\n", id, l->count, l->segmentCount, (unsigned long long)l->size);
+
+    /* Every key is known, the held writes can be deduplicated */
+    for (uint32_t off = 0; off < load->heldSize; off += sizeof(*header) + header->size)
     {
-        l = app->ledgers + i;
-        if (!l->valid)
-            continue;
-        if (memcmp(uuid, l->uuid, 16))
-            continue;
-        l->refCount++;
-        return i;
+        header = (const LedgerEntryHeader*)(load->held + off);
+        multiLedgerWrite(app, id, header);
     }
+    free(load->held);
+    free(load);
 
-    /* Try to re-use a ledger ID */
-    id = -1;
-    for (int i = 0; i < app->ledgerSize; ++i)
+    /* Clients may have joined past the end while it was unknown */
+    for (int j = l->clientCount - 1; j >= 0; --j)
     {
-        l = app->ledgers + i;
-        if (!l->valid)
+        if (j >= l->clientCount)
+            continue;
+        c = APP_CLIENT(app, l->clients[j]);
+        if (c->ledgerBase > l->count)
         {
-            id = i;
-            break;
+            fprintf(stderr, "Client #%d: Invalid base %d\n", c->id, c->ledgerBase);
+            multiClientRemove(app, c);
         }
+        else
+            multiClientTransferLedger(app, c);
     }
+}
+
+/**
+ * Run one step of a ledger load: a run of keys from the index file, then
+ * a block of the data file.
+ * Entries are released to the clients as soon as they are indexed.
+ * @return 1 once the ledger is loaded, 0 otherwise
+ */
+static int ledgerLoadStep(App* app, int id)
+{
+    Ledger* l;
+    LedgerLoad* load;
+    uint32_t end;
 
-    if (id == -1)
+    l = app->ledgers + id;
+    load = l->load;
+    if (load->recordPos < load->recordCount)
     {
-        /* None exists - create one */
-        if (app->ledgerSize == app->ledgerCapacity)
+        end = load->recordPos + LEDGER_LOAD_KEYS;
+        if (end > load->recordCount)
+            end = load->recordCount;
+        for (uint32_t i = load->recordPos; i < end; ++i)
+            hashset64Add(&l->keysSet, load->records[i].key);
+        load->recordPos = end;
+    }
+    else if (l->size < load->totalSize && ledgerLoadScan(l, load, id))
+    {
+        /* Given up on by multiLedgerLoad */
+        l->failed = 1;
+        return 0;
+    }
+
+    if (load->recordPos == load->recordCount && l->size == load->totalSize)
+    {
+        ledgerLoadFinish(app, id);
+        ledgerIdleResize(app, l);
+        if (l->valid && l->closing)
+            multiLedgerClose(app, id);
+        return 1;
+    }
+    ledgerIdleResize(app, l);
+
+    /* Release the entries indexed so far */
+    if (l->durableCount != l->count)
+    {
+        l->durableCount = l->count;
+        ledgerMap(l);
+        for (int j = l->clientCount - 1; j >= 0; --j)
         {
-            app->ledgerCapacity *= 2;
-            app->ledgers = realloc(app->ledgers, sizeof(Ledger) * app->ledgerCapacity);
+            if (j < l->clientCount)
+                multiClientTransferLedger(app, APP_CLIENT(app, l->clients[j]));
         }
-        id = app->ledgerSize++;
     }
-
-    /* Create the ledger */
-    makeLedger(app, uuid, id);
-    app->ledgers[id].refCount++;
-    return id;
+    return 0;
 }
 
-void multiLedgerClose(App* app, int id)
+/**
+ * Start loading a ledger, from the index file if it is valid.
+ * Ledgers that take more than a step keep loading across loop iterations.
+ * A ledger that already holds writes back keeps them for the end of the
+ * load.
+ */
+static void ledgerLoadBegin(App* app, int id)
 {
     Ledger* l;
-    Client* c;
+    LedgerLoad* load;
 
     l = app->ledgers + id;
-    if (!l->valid)
-        return;
+    load = l->load ? l->load : calloc(1, sizeof(LedgerLoad));
+    l->load = load;
 
-    /* Close the ledger */
-    close(l->fileData);
-    l->fileData = -1;
-    l->valid = 0;
-    free(l->index);
-    hashset64Free(&l->keysSet);
+    /* Get the total size */
+    load->totalSize = lseek(l->fileData, 0, SEEK_END);
+    lseek(l->fileData, 0, SEEK_SET);
 
-    fprintf(stderr, "Ledger #%d: Closed\n", id);
+    /* Start from the index checkpoint, only the entries past it are scanned */
+    if (l->fileIndex != -1 && load->totalSize && ledgerLoadIndex(l, load))
+        fprintf(stderr, "Ledger #%d: Rebuilding the index\n", id);
+    l->indexCheckpoint = l->count;
+    l->durableCount = l->count;
+    load->scanBase = l->size;
+    load->scanCount = l->count;
+    ledgerMap(l);
 
-    /* Close every client connected to that ledger */
-    for (int i = 0; i < app->clientSize; ++i)
+    if (ledgerLoadStep(app, id))
+        return;
+
+    if (app->loadSize == app->loadCapacity)
     {
-        c = app->clients + i;
-        if (!c->valid)
-            continue;
-        if (c->ledgerId != id)
-            continue;
-        multiClientDisconnect(app, c);
+        app->loadCapacity = app->loadCapacity ? app->loadCapacity * 2 : 4;
+        app->loadQueue = realloc(app->loadQueue, sizeof(int) * app->loadCapacity);
     }
+    app->loadQueue[app->loadSize++] = id;
+    fprintf(stderr, "Ledger #%d: Loading (bytes: %llu)\n", id, (unsigned long long)load->totalSize);
 }
 
-static const char kZero[16] = { 0 };
+/**
+ * Get the directory of a ledger.
+ */
+static void ledgerDir(App* app, const char* uuid, char* buf, size_t size)
+{
+    const uint8_t* u;
+
+    u = (const uint8_t*)uuid;
+    snprintf(buf, size, "%s/ledgers/%02x/%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x", app->dataDir, u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+}
+
+/**
+ * Get the path of the head data file starting at entry base.
+ */
+static void ledgerHeadPath(char* buf, size_t size, const char* dir, uint32_t base)
+{
+    if (base)
+        snprintf(buf, size, "%s/data-%08x", dir, base);
+    else
+        snprintf(buf, size, "%s/data", dir);
+}
 
-static int fileWrite(int fd, const void* data, int size)
+static void ledgerSegmentPath(char* buf, size_t size, const char* dir, uint32_t first)
 {
+    snprintf(buf, size, "%s/seg-%08x", dir, first);
+}
+
+/**
+ * Make the renames and removals in a ledger directory durable.
+ */
+static int ledgerSyncDir(const char* dir)
+{
+    int fd;
     int ret;
 
-    while (size)
+    fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        return -1;
+    ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+/**
+ * Map the sealed segments of a ledger and pick its head data file.
+ * The head is the data file right after the last segment. A compaction
+ * that was cut short may leave segments past the newest head, they are
+ * ignored, and older heads, they are removed.
+ * @return The base of the head
+ */
+static uint32_t ledgerOpenSegments(Ledger* l, int id, const char* dir)
+{
+    char buf[560];
+    DIR* d;
+    struct dirent* e;
+    uint32_t capacity;
+    uint32_t base;
+    uint32_t heads;
+    unsigned int value;
+
+    capacity = 0;
+    for (;;)
     {
-        ret = write(fd, data, size);
-        if (ret < 0)
-            return -1;
-        data = (const char*)data + ret;
-        size -= ret;
+        if (l->segmentCount == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            l->segments = realloc(l->segments, sizeof(LedgerSegment) * capacity);
+        }
+        ledgerSegmentPath(buf, sizeof(buf), dir, l->segmentCount * LEDGER_SEGMENT_ENTRIES);
+        if (multiSegmentOpen(&l->segments[l->segmentCount], buf, l->segmentCount * LEDGER_SEGMENT_ENTRIES))
+            break;
+        l->segmentCount++;
     }
 
-    return 0;
+    /* Find the newest head the segments lead up to */
+    d = opendir(dir);
+    if (!d)
+        return 0;
+    base = 0;
+    heads = 0;
+    while ((e = readdir(d)))
+    {
+        if (strcmp(e->d_name, "data") == 0)
+            value = 0;
+        else if (sscanf(e->d_name, "data-%8x", &value) != 1 || strlen(e->d_name) != 13 || value % LEDGER_SEGMENT_ENTRIES)
+            continue;
+        heads++;
+        if (value <= l->segmentCount * LEDGER_SEGMENT_ENTRIES && value > base)
+            base = value;
+    }
+    closedir(d);
+
+    /* Drop the segments past it, and the heads before it */
+    while (l->segmentCount * LEDGER_SEGMENT_ENTRIES > base)
+        multiSegmentClose(&l->segments[--l->segmentCount]);
+    if (heads > 1)
+    {
+        for (uint32_t b = 0; b < base; b += LEDGER_SEGMENT_ENTRIES)
+        {
+            ledgerHeadPath(buf, sizeof(buf), dir, b);
+            if (!unlink(buf))
+                fprintf(stderr, "Ledger #%d: Removed stale head %s\n", id, buf);
+        }
+    }
+
+    return base;
 }
 
-void multiLedgerWrite(App* app, int ledgerId, const void* data)
+/**
+ * Open the files of a ledger and start loading it.
+ * @param load The writes held back until the ledger is loaded, or NULL
+ * @return 0 on success, -1 on error
+ */
+static int ledgerOpenFiles(App* app, int id, LedgerLoad* load)
 {
     Ledger* l;
-    int padding;
-    const LedgerEntryHeader* header;
+    char buf[560];
+    char bufBase[512];
 
-    l = app->ledgers + ledgerId;
-    header = (const LedgerEntryHeader*)data;
+    l = app->ledgers + id;
+    l->indexPages = NULL;
+    l->indexPageCount = 0;
+    l->indexPageCapacity = 0;
+    l->segments = NULL;
+    l->segmentCount = 0;
+    hashset64Init(&l->keysSet);
 
-    /* Check for an existing key */
-    if (hashset64Contains(&l->keysSet, header->key))
-        return;
+    /* Open ledger files */
+    snprintf(bufBase, sizeof(bufBase), "%s/ledgers/%02x", app->dataDir, (uint8_t)l->uuid[0]);
+    mkdir(bufBase, 0755);
+    ledgerDir(app, l->uuid, bufBase, sizeof(bufBase));
+    mkdir(bufBase, 0755);
+    l->sealedCount = ledgerOpenSegments(l, id, bufBase);
+    ledgerHeadPath(buf, sizeof(buf), bufBase, l->sealedCount);
+    l->fileData = open(buf, O_APPEND | O_RDWR | O_CREAT, 0644);
+    if (l->fileData == -1)
+    {
+        perror("open");
+        while (l->segmentCount)
+            multiSegmentClose(&l->segments[--l->segmentCount]);
+        free(l->segments);
+        l->segments = NULL;
+        hashset64Free(&l->keysSet);
+        l->fileIndex = -1;
+        if (load)
+        {
+            free(load->held);
+            free(load);
+        }
+        return -1;
+    }
 
-    /* Write the index */
-    ledgerSetIndex(l, l->count, l->size);
+    /* The sealed entries have no index pages */
+    ledgerIndexPages(l, l->sealedCount);
+    for (uint32_t i = 0; i < l->sealedCount / LEDGER_INDEX_PAGE; ++i)
+        l->indexPages[i] = NULL;
+    l->indexPageCount = l->sealedCount / LEDGER_INDEX_PAGE;
+    snprintf(buf, sizeof(buf), "%s/index", bufBase);
+    l->fileIndex = open(buf, O_RDWR | O_CREAT, 0644);
+    if (l->fileIndex == -1)
+        perror("open");
+    l->count = l->sealedCount;
+    l->size = 0;
+    l->pending = NULL;
+    l->pendingSize = 0;
+    l->pendingCapacity = 0;
+    l->syncQueued = 0;
+    l->writeErrors = 0;
+    l->failed = 0;
+    l->map = NULL;
+    l->mapSize = 0;
+    l->cache = NULL;
+    l->cacheBase = 0;
+    l->cacheSize = 0;
+    l->cacheCapacity = 0;
+    l->cacheHits = 0;
+    l->cacheMisses = 0;
+    l->sealedReads = 0;
+    l->flushing = 0;
+    l->flushSize = 0;
+    l->spare = NULL;
+    l->spareCapacity = 0;
+    l->load = load;
+    l->lz4Blocks = NULL;
+    l->lz4BlockCount = 0;
+    l->lz4Size = 0;
 
-    /* Write the data */
-    fileWrite(l->fileData, data, sizeof(*header) + header->size);
-    padding = paddingSize(sizeof(*header) + header->size);
-    fileWrite(l->fileData, kZero, padding);
+    /* Load ledger data */
+    ledgerLoadBegin(app, id);
 
-    /* Update ledger info */
-    l->size += sizeof(*header) + header->size + padding;
-    l->count++;
+    return 0;
+}
+
+static int makeLedger(App* app, const char* uuid, int id)
+{
+    Ledger* l;
+
+    l = app->ledgers + id;
+
+    /* Init the ledger */
+    l->valid = 1;
+    memcpy(l->uuid, uuid, 16);
+    l->refCount = 0;
+    l->clients = NULL;
+    l->clientCount = 0;
+    l->clientCapacity = 0;
+    l->closing = 0;
+    l->compacting = 0;
+    l->idle = 0;
 
-    /* Sync */
-    fsync(l->fileData);
+    if (ledgerOpenFiles(app, id, NULL))
+    {
+        l->valid = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint32_t ledgerHash(const char* uuid)
+{
+    uint64_t a;
+    uint64_t b;
+
+    memcpy(&a, uuid, 8);
+    memcpy(&b, uuid + 8, 8);
+    return hashset64Hash(a ^ (b * 0x9e3779b97f4a7c15ULL));
+}
+
+/**
+ * Get the shard owning a ledger.
+ * Shards are numbered process by process: shard / workerCount is the
+ * process, shard % workerCount the worker within it.
+ */
+int multiLedgerShard(App* app, const char* uuid)
+{
+    return (int)(((uint64_t)ledgerHash(uuid) * (uint32_t)(app->processCount * app->workerCount)) >> 32);
+}
+
+/**
+ * Find the bucket holding a ledger, or the empty bucket where it belongs.
+ */
+static int* ledgerTableFind(App* app, const char* uuid)
+{
+    uint32_t mask;
+    uint32_t bucket;
+    int id;
+
+    mask = app->ledgerTableCapacity - 1;
+    bucket = ledgerHash(uuid) & mask;
+    for (;;)
+    {
+        id = app->ledgerTable[bucket];
+        if (id == -1 || !memcmp(app->ledgers[id].uuid, uuid, 16))
+            return &app->ledgerTable[bucket];
+        bucket = (bucket + 1) & mask;
+    }
+}
+
+static void ledgerTableGrow(App* app)
+{
+    free(app->ledgerTable);
+    app->ledgerTableCapacity *= 2;
+    app->ledgerTable = malloc(sizeof(int) * app->ledgerTableCapacity);
+    memset(app->ledgerTable, 0xff, sizeof(int) * app->ledgerTableCapacity);
+
+    for (int i = 0; i < app->ledgerSize; ++i)
+    {
+        if (app->ledgers[i].valid)
+            *ledgerTableFind(app, app->ledgers[i].uuid) = i;
+    }
+}
+
+/**
+ * Remove a ledger from the table, shifting back the buckets that follow it
+ * so that no tombstone is needed.
+ */
+static void ledgerTableRemove(App* app, int id)
+{
+    uint32_t mask;
+    uint32_t i;
+    uint32_t j;
+    uint32_t k;
+
+    mask = app->ledgerTableCapacity - 1;
+    i = (uint32_t)(ledgerTableFind(app, app->ledgers[id].uuid) - app->ledgerTable);
+    j = i;
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (app->ledgerTable[j] == -1)
+            break;
+
+        /* Move the bucket back unless its home lies in (i, j] */
+        k = ledgerHash(app->ledgers[app->ledgerTable[j]].uuid) & mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        app->ledgerTable[i] = app->ledgerTable[j];
+        i = j;
+    }
+    app->ledgerTable[i] = -1;
+}
+
+/**
+ * Take a ledger off the idle list.
+ */
+static void ledgerIdleUnlink(App* app, int id)
+{
+    Ledger* l;
+
+    l = app->ledgers + id;
+    if (l->idlePrev != -1)
+        app->ledgers[l->idlePrev].idleNext = l->idleNext;
+    else
+        app->idleHead = l->idleNext;
+    if (l->idleNext != -1)
+        app->ledgers[l->idleNext].idlePrev = l->idlePrev;
+    else
+        app->idleTail = l->idlePrev;
+    app->idleCount--;
+    app->idleSize -= l->idleSize;
+    l->idle = 0;
+}
+
+int multiLedgerOpen(App* app, const char* uuid)
+{
+    int* bucket;
+    int id;
+
+    /* Find a previous ledger */
+    if ((app->ledgerCount + 1) * 2 > (int)app->ledgerTableCapacity)
+        ledgerTableGrow(app);
+    bucket = ledgerTableFind(app, uuid);
+    if (*bucket != -1)
+    {
+        if (app->ledgers[*bucket].idle)
+        {
+            ledgerIdleUnlink(app, *bucket);
+            app->stats.ledgerHits++;
+        }
+
+        /* Writes wait for the close job in flight, the ledger is then
+         * loaded again from its new files, see ledgerClosed */
+        if (app->ledgers[*bucket].compacting && !app->ledgers[*bucket].load)
+            app->ledgers[*bucket].load = calloc(1, sizeof(LedgerLoad));
+        app->ledgers[*bucket].refCount++;
+        app->ledgers[*bucket].closing = 0;
+        return *bucket;
+    }
+
+    /* Try to re-use a ledger ID */
+    id = app->ledgerFree;
+    if (id != -1)
+        app->ledgerFree = app->ledgers[id].nextFree;
+    else
+    {
+        /* None exists - create one */
+        if (app->ledgerSize == app->ledgerCapacity)
+        {
+            app->ledgerCapacity *= 2;
+            app->ledgers = realloc(app->ledgers, sizeof(Ledger) * app->ledgerCapacity);
+        }
+        id = app->ledgerSize++;
+    }
+
+    /* Create the ledger */
+    if (makeLedger(app, uuid, id))
+    {
+        app->ledgers[id].nextFree = app->ledgerFree;
+        app->ledgerFree = id;
+        return -1;
+    }
+    *bucket = id;
+    app->ledgerCount++;
+    app->ledgers[id].refCount++;
+    app->stats.ledgerLoads++;
+    return id;
+}
+
+static const char kZero[16] = { 0 };
+
+/**
+ * Check the sealed segments for a key, their keys are never added to the
+ * key set.
+ */
+static int ledgerSealedContains(Ledger* l, uint64_t key)
+{
+    for (uint32_t i = 0; i < l->segmentCount; ++i)
+    {
+        if (multiSegmentContains(&l->segments[i], key))
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Queue a ledger for the next group commit, due by deadline at the latest.
+ */
+static void ledgerQueueSync(App* app, int ledgerId, uint64_t deadline)
+{
+    if (app->syncSize == app->syncCapacity)
+    {
+        app->syncCapacity *= 2;
+        app->syncQueue = realloc(app->syncQueue, sizeof(int) * app->syncCapacity);
+    }
+    if (app->syncSize == 0 || deadline < app->syncDeadline)
+        app->syncDeadline = deadline;
+    app->syncQueue[app->syncSize++] = ledgerId;
+    app->ledgers[ledgerId].syncQueued = 1;
+}
+
+void multiLedgerWrite(App* app, int ledgerId, const void* data)
+{
+    Ledger* l;
+    LedgerLoad* load;
+    uint32_t size;
+    uint32_t padding;
+    const LedgerEntryHeader* header;
+
+    l = app->ledgers + ledgerId;
+    header = (const LedgerEntryHeader*)data;
+
+    /* Hold the write back until every key is known */
+    if (l->load)
+    {
+        load = l->load;
+        size = sizeof(*header) + header->size;
+        while (load->heldSize + size > load->heldCapacity)
+        {
+            load->heldCapacity = load->heldCapacity ? load->heldCapacity * 2 : 1024;
+            load->held = realloc(load->held, load->heldCapacity);
+        }
+        memcpy(load->held + load->heldSize, data, size);
+        load->heldSize += size;
+        return;
+    }
+
+    /* Writes to a failed ledger are lost with its clients */
+    if (l->failed)
+        return;
+
+    /* Check for an existing key */
+    if (hashset64Contains(&l->keysSet, header->key) || ledgerSealedContains(l, header->key))
+        return;
+
+    /* Write the index */
+    ledgerSetIndex(l, l->count, l->size);
+
+    /* Append the data to the pending batch */
+    size = sizeof(*header) + header->size;
+    padding = paddingSize(size);
+    while (l->pendingSize + size + padding > l->pendingCapacity)
+    {
+        l->pendingCapacity = l->pendingCapacity ? l->pendingCapacity * 2 : 1024;
+        l->pending = realloc(l->pending, l->pendingCapacity);
+    }
+    memcpy(l->pending + l->pendingSize, data, size);
+    memcpy(l->pending + l->pendingSize + size, kZero, padding);
+    l->pendingSize += size + padding;
+
+    /* Update ledger info */
+    l->size += size + padding;
+    l->count++;
 
     /* Add the key */
     hashset64Add(&l->keysSet, header->key);
+
+    /* Queue the ledger for the next group commit */
+    if (!l->syncQueued)
+        ledgerQueueSync(app, ledgerId, multiTimeMs() + app->syncWindow);
+}
+
+/**
+ * Write the index of a new head data file, holding count entries from
+ * base on.
+ * @return 0 on success, -1 on error
+ */
+static int ledgerCompactIndex(const char* dir, const char* data, uint64_t dataSize, uint32_t base, uint32_t count)
+{
+    LedgerIndexHeader* header;
+    LedgerIndexRecord* records;
+    const LedgerEntryHeader* entry;
+    char path[560];
+    char* buf;
+    size_t size;
+    uint64_t off;
+    uint32_t entrySize;
+    int ret;
+
+    size = sizeof(*header) + sizeof(*records) * (size_t)count;
+    buf = malloc(size);
+    if (!buf)
+        return -1;
+    header = (LedgerIndexHeader*)buf;
+    records = (LedgerIndexRecord*)(buf + sizeof(*header));
+    memcpy(header->magic, LEDGER_INDEX_MAGIC, sizeof(header->magic));
+    header->base = base;
+    header->count = count;
+    header->size = dataSize;
+    off = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        entry = (const LedgerEntryHeader*)(data + off);
+        records[i].key = entry->key;
+        records[i].offset = off;
+        entrySize = sizeof(*entry) + entry->size;
+        off += entrySize + paddingSize(entrySize);
+    }
+
+    snprintf(path, sizeof(path), "%s/index", dir);
+    ret = multiFileReplace(path, buf, size);
+    free(buf);
+    return ret;
+}
+
+/**
+ * Seal every full segment of the head data file of a closing ledger, then
+ * move the rest of the head to a new data file with its own index.
+ * The segments are durable before the new head shows up, and the old head
+ * is only removed after it, so a compaction cut short loses nothing.
+ * @return 0 if the ledger was compacted, -1 otherwise
+ */
+static int ledgerCompactFiles(App* app, const PersistJob* job)
+{
+    char dir[512];
+    char path[560];
+    const LedgerEntryHeader* entry;
+    const char* map;
+    char* buf;
+    size_t bufSize;
+    size_t bufCapacity;
+    uint64_t off;
+    uint32_t base;
+    uint32_t size;
+    int ret;
+
+    base = job->base + (job->count - job->base) / LEDGER_SEGMENT_ENTRIES * LEDGER_SEGMENT_ENTRIES;
+    if (base == job->base || !job->offset)
+        return -1;
+    ledgerDir(app, job->uuid, dir, sizeof(dir));
+
+    /* The head is read through a mapping of its own */
+    map = mmap(NULL, job->offset, PROT_READ, MAP_SHARED, job->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    /* Seal, packing the entries without their padding */
+    buf = NULL;
+    bufCapacity = 0;
+    off = 0;
+    ret = 0;
+    for (uint32_t first = job->base; first < base && !ret; first += LEDGER_SEGMENT_ENTRIES)
+    {
+        bufSize = 0;
+        for (uint32_t i = 0; i < LEDGER_SEGMENT_ENTRIES && !ret; ++i)
+        {
+            entry = (const LedgerEntryHeader*)(map + off);
+            size = sizeof(*entry) + entry->size;
+            if (off + size > job->offset)
+            {
+                ret = -1;
+                break;
+            }
+            while (bufSize + size > bufCapacity)
+            {
+                bufCapacity = bufCapacity ? bufCapacity * 2 : 1024 * 1024;
+                buf = realloc(buf, bufCapacity);
+            }
+            memcpy(buf + bufSize, entry, size);
+            bufSize += size;
+            off += size + paddingSize(size);
+        }
+        ledgerSegmentPath(path, sizeof(path), dir, first);
+        if (!ret)
+            ret = multiSegmentWrite(path, first, LEDGER_SEGMENT_ENTRIES, buf, bufSize);
+    }
+    free(buf);
+
+    /* Move the rest of the head */
+    if (!ret)
+    {
+        ledgerHeadPath(path, sizeof(path), dir, base);
+        ret = multiFileReplace(path, map + off, job->offset - off) || ledgerCompactIndex(dir, map + off, job->offset - off, base, job->count - base) || ledgerSyncDir(dir);
+    }
+    munmap((void*)map, job->offset);
+    if (ret)
+        return -1;
+
+    /* The old head is covered by the segments and the new head */
+    ledgerHeadPath(path, sizeof(path), dir, job->base);
+    unlink(path);
+
+    return 0;
+}
+
+/**
+ * Run the close job of a ledger: compact it, or checkpoint its index when
+ * there is nothing to seal so the next open has no tail to scan.
+ * Called by the persistence thread, so only the job is used.
+ */
+void multiLedgerCompact(App* app, PersistJob* job)
+{
+    job->written = !ledgerCompactFiles(app, job);
+    if (!job->written && job->indexFd != -1 && job->checkpoint != job->count)
+        job->checkpointed = !multiLedgerIndexCheckpoint(job->indexFd, job->base, job->count - job->base, job->offset);
+}
+
+/**
+ * Hand the file work of a close to the persistence thread.
+ * @return 1 if a close job was queued, 0 if there is nothing to do
+ */
+static int ledgerCloseSubmit(App* app, int id)
+{
+    PersistJob job;
+    Ledger* l;
+    uint32_t base;
+
+    l = app->ledgers + id;
+    base = l->sealedCount + (l->count - l->sealedCount) / LEDGER_SEGMENT_ENTRIES * LEDGER_SEGMENT_ENTRIES;
+    if (!app->persist || l->failed)
+        return 0;
+    if (base == l->sealedCount && (l->fileIndex == -1 || l->indexCheckpoint == l->count))
+        return 0;
+
+    memset(&job, 0, sizeof(job));
+    job.ledgerId = id;
+    job.compact = 1;
+    memcpy(job.uuid, l->uuid, 16);
+    job.fd = l->fileData;
+    job.offset = l->size;
+    job.count = l->count;
+    job.indexFd = l->fileIndex;
+    job.base = l->sealedCount;
+    job.checkpoint = l->indexCheckpoint;
+    if (multiPersistSubmit(app, &job))
+        return 0;
+    multiPersistWake(app);
+    l->compacting = 1;
+
+    return 1;
+}
+
+/**
+ * Close the files of a ledger and free everything it holds but its
+ * subscribers.
+ */
+static void ledgerCloseFiles(Ledger* l)
+{
+    if (l->map)
+        munmap((void*)l->map, l->mapSize);
+    l->map = NULL;
+    l->mapSize = 0;
+    if (l->fileData != -1)
+        close(l->fileData);
+    l->fileData = -1;
+    if (l->fileIndex != -1)
+        close(l->fileIndex);
+    l->fileIndex = -1;
+    while (l->segmentCount)
+        multiSegmentClose(&l->segments[--l->segmentCount]);
+    free(l->segments);
+    l->segments = NULL;
+    ledgerIndexFree(l);
+    free(l->pending);
+    l->pending = NULL;
+    free(l->spare);
+    l->spare = NULL;
+    free(l->cache);
+    l->cache = NULL;
+    for (uint32_t i = 0; i < l->lz4BlockCount; ++i)
+    {
+        if (l->lz4Blocks[i])
+            frameUnref(l->lz4Blocks[i]);
+    }
+    free(l->lz4Blocks);
+    l->lz4Blocks = NULL;
+    l->lz4BlockCount = 0;
+    l->lz4Size = 0;
+    hashset64Free(&l->keysSet);
+}
+
+/**
+ * Release the ID of a ledger and close it, along with its clients.
+ */
+static void ledgerCloseFinish(App* app, int id)
+{
+    Ledger* l;
+
+    l = app->ledgers + id;
+    l->closing = 0;
+
+    /* Release the ledger ID */
+    ledgerTableRemove(app, id);
+    l->nextFree = app->ledgerFree;
+    app->ledgerFree = id;
+    app->ledgerCount--;
+
+    /* Close the ledger */
+    ledgerCloseFiles(l);
+    l->valid = 0;
+
+    fprintf(stderr, "Ledger #%d: Closed (cache hits: %llu, misses: %llu, sealed reads: %llu)\n", id, (unsigned long long)l->cacheHits, (unsigned long long)l->cacheMisses, (unsigned long long)l->sealedReads);
+
+    /* Close every client connected to that ledger */
+    while (l->clientCount)
+        multiClientDisconnect(app, APP_CLIENT(app, l->clients[l->clientCount - 1]));
+    free(l->clients);
+    l->clients = NULL;
+}
+
+void multiLedgerClose(App* app, int id)
+{
+    Ledger* l;
+
+    l = app->ledgers + id;
+    if (!l->valid)
+        return;
+    if (l->idle)
+        ledgerIdleUnlink(app, id);
+
+    /* The close job in flight finishes the close, see ledgerClosed */
+    if (l->compacting)
+    {
+        l->closing = 1;
+        return;
+    }
+
+    /* A load holding writes back goes on, ledgerLoadStep closes the
+     * ledger once it is done. Any other load is given up, the head is
+     * not sealed then since part of it is unknown */
+    if (l->load)
+    {
+        if (l->load->heldSize && !l->failed)
+        {
+            l->closing = 1;
+            return;
+        }
+        ledgerLoadAbort(app, id);
+        ledgerCloseFinish(app, id);
+        return;
+    }
+
+    /* Pending entries must be durable first, multiLedgerPersisted
+     * finishes the close */
+    if (l->pendingSize || l->flushing)
+    {
+        l->closing = 1;
+        return;
+    }
+
+    /* Seal what the head holds off the event loop. The ledger stays in the
+     * table meanwhile, so that it is not opened twice. A failed ledger
+     * leaves its files as they are */
+    if (ledgerCloseSubmit(app, id))
+    {
+        l->closing = 1;
+        return;
+    }
+
+    ledgerCloseFinish(app, id);
+}
+
+/**
+ * Close the least recently released idle ledger.
+ */
+static void ledgerEvict(App* app)
+{
+    app->stats.ledgerEvictions++;
+    multiLedgerClose(app, app->idleHead);
+}
+
+/**
+ * Called once the last client of a ledger is gone.
+ * The ledger stays open on the idle list, so that clients reconnecting
+ * shortly after find it loaded. The least recently released ledgers are
+ * closed once the idle ones use more than the retention budget.
+ */
+void multiLedgerRelease(App* app, int id)
+{
+    Ledger* l;
+
+    l = app->ledgers + id;
+    if (!app->retainMax || !app->retainTtl || l->failed)
+    {
+        multiLedgerClose(app, id);
+        return;
+    }
+
+    /* Append to the idle list, most recent last */
+    l->idle = 1;
+    l->idleSince = app->tick;
+    l->idleSize = ledgerIdleSize(l);
+    l->idlePrev = app->idleTail;
+    l->idleNext = -1;
+    if (app->idleTail != -1)
+        app->ledgers[app->idleTail].idleNext = id;
+    else
+        app->idleHead = id;
+    app->idleTail = id;
+    app->idleCount++;
+    app->idleSize += l->idleSize;
+
+    /* Stay within the budget, every eviction takes its size off */
+    while (app->idleHead != -1 && app->idleSize > app->retainMax)
+        ledgerEvict(app);
+}
+
+/**
+ * Close the ledgers that have been idle for longer than the retention TTL,
+ * and the oldest ones while the idle ledgers grew past the budget.
+ */
+void multiLedgerExpire(App* app)
+{
+    while (app->idleHead != -1 && app->tick - app->ledgers[app->idleHead].idleSince >= app->retainTtl)
+        ledgerEvict(app);
+    while (app->idleHead != -1 && app->idleSize > app->retainMax)
+        ledgerEvict(app);
+}
+
+void multiLedgerSubscribe(App* app, int ledgerId, Client* client)
+{
+    Ledger* l;
+
+    l = app->ledgers + ledgerId;
+    if (l->clientCount == l->clientCapacity)
+    {
+        l->clientCapacity = l->clientCapacity ? l->clientCapacity * 2 : 4;
+        l->clients = realloc(l->clients, sizeof(int) * l->clientCapacity);
+    }
+    client->ledgerSlot = l->clientCount;
+    l->clients[l->clientCount++] = client->id;
+}
+
+void multiLedgerUnsubscribe(App* app, Client* client)
+{
+    Ledger* l;
+    int last;
+
+    l = app->ledgers + client->ledgerId;
+
+    /* Swap with the last subscriber */
+    last = l->clients[--l->clientCount];
+    l->clients[client->ledgerSlot] = last;
+    APP_CLIENT(app, last)->ledgerSlot = client->ledgerSlot;
+}
+
+/**
+ * Get a durable entry, header followed by payload.
+ * The entry is served from the tail cache or the mapping when possible,
+ * otherwise it is read into scratch, which must hold at least
+ * sizeof(LedgerEntryHeader) + 255 bytes.
+ * With a NULL scratch, NULL is returned for entries that are not in memory.
+ */
+const LedgerEntryHeader* multiLedgerEntry(App* app, int ledgerId, uint32_t entryId, void* scratch)
+{
+    Ledger* l;
+    LedgerEntryHeader* header;
+    uint64_t off;
+    uint64_t cacheEnd;
+
+    l = app->ledgers + ledgerId;
+
+    /* Sealed read */
+    if (entryId < l->sealedCount)
+    {
+        l->sealedReads++;
+        app->stats.sealedReads++;
+        return multiSegmentEntry(&l->segments[entryId / LEDGER_SEGMENT_ENTRIES], entryId % LEDGER_SEGMENT_ENTRIES);
+    }
+    off = ledgerOffset(l, entryId);
+
+    /* Cached read */
+    cacheEnd = l->cacheBase + l->cacheSize;
+    if (off >= l->cacheBase && off + sizeof(*header) <= cacheEnd)
+    {
+        header = (LedgerEntryHeader*)(l->cache + (off - l->cacheBase));
+        if (off + sizeof(*header) + header->size <= cacheEnd)
+        {
+            l->cacheHits++;
+            app->stats.cacheHits++;
+            return header;
+        }
+    }
+    l->cacheMisses++;
+    app->stats.cacheMisses++;
+
+    /* Mapped read */
+    if (l->map)
+        return (const LedgerEntryHeader*)(l->map + off);
+
+    /* Fallback */
+    if (!scratch)
+        return NULL;
+    header = (LedgerEntryHeader*)scratch;
+    multiFilePread(l->fileData, header, off, sizeof(*header));
+    multiFilePread(l->fileData, header + 1, off + sizeof(*header), header->size);
+    return header;
+}
+
+/**
+ * Get the OP_TRANSFER_LZ4 frame of a block of durable entries, compressing
+ * it on first use.
+ * The frame stays cached until the ledger is closed, entries never change
+ * once durable.
+ * @return A frame owned by the ledger, NULL on error
+ */
+Frame* multiLedgerBlock(App* app, int ledgerId, uint32_t block)
+{
+    char scratch[sizeof(LedgerEntryHeader) + 256];
+    Ledger* l;
+    Frame* frame;
+    Frame* newFrame;
+    const LedgerEntryHeader* entry;
+    char* raw;
+    uint32_t rawSize;
+    uint32_t rawCapacity;
+    uint32_t count;
+    uint32_t size;
+    uint32_t first;
+
+    l = app->ledgers + ledgerId;
+    first = block * LEDGER_LZ4_BLOCK;
+    if (first + LEDGER_LZ4_BLOCK > l->durableCount)
+        return NULL;
+    if (block < l->lz4BlockCount && l->lz4Blocks[block])
+    {
+        app->stats.lz4Hits++;
+        return l->lz4Blocks[block];
+    }
+
+    /* Lay the messages out as they would be sent one by one */
+    raw = NULL;
+    rawSize = 0;
+    rawCapacity = 0;
+    for (uint32_t i = 0; i < LEDGER_LZ4_BLOCK; ++i)
+    {
+        entry = multiLedgerEntry(app, ledgerId, first + i, scratch);
+        size = 1 + sizeof(*entry) + entry->size;
+        while (rawSize + size > rawCapacity)
+        {
+            rawCapacity = rawCapacity ? rawCapacity * 2 : 16384;
+            raw = realloc(raw, rawCapacity);
+        }
+        raw[rawSize] = OP_TRANSFER;
+        memcpy(raw + rawSize + 1, entry, size - 1);
+        rawSize += size;
+    }
+
+    /* Compress, then give back the slack */
+    frame = frameNew(13 + lz4Bound(rawSize));
+    if (!frame)
+    {
+        free(raw);
+        return NULL;
+    }
+    frame->shared = 1;
+    size = lz4Compress(raw, rawSize, frame->data + 13);
+    free(raw);
+    frame->data[0] = OP_TRANSFER_LZ4;
+    count = LEDGER_LZ4_BLOCK;
+    memcpy(frame->data + 1, &count, 4);
+    memcpy(frame->data + 5, &rawSize, 4);
+    memcpy(frame->data + 9, &size, 4);
+    frame->size = 13 + size;
+    newFrame = realloc(frame, sizeof(*frame) + frame->size);
+    if (newFrame)
+    {
+        frame = newFrame;
+        frame->capacity = frame->size;
+    }
+
+    /* Cache */
+    if (block >= l->lz4BlockCount)
+    {
+        l->lz4Blocks = realloc(l->lz4Blocks, sizeof(Frame*) * (block + 1));
+        memset(l->lz4Blocks + l->lz4BlockCount, 0, sizeof(Frame*) * (block + 1 - l->lz4BlockCount));
+        l->lz4BlockCount = block + 1;
+    }
+    l->lz4Blocks[block] = frame;
+    l->lz4Size += frame->size;
+    app->stats.lz4Builds++;
+    app->stats.lz4RawBytes += rawSize;
+    app->stats.lz4Bytes += frame->size;
+
+    return frame;
+}
+
+/**
+ * Encode a pending batch once as a shared frame of OP_TRANSFER messages.
+ */
+static Frame* ledgerBatchFrame(const char* data, uint32_t dataSize, uint32_t count)
+{
+    Frame* frame;
+    const LedgerEntryHeader* header;
+    uint32_t off;
+    uint32_t size;
+
+    frame = frameNew(dataSize + count);
+    if (!frame)
+        return NULL;
+    frame->shared = 1;
+
+    off = 0;
+    while (off < dataSize)
+    {
+        header = (const LedgerEntryHeader*)(data + off);
+        size = sizeof(*header) + header->size;
+        frame->data[frame->size++] = OP_TRANSFER;
+        memcpy(frame->data + frame->size, header, size);
+        frame->size += size;
+        off += size + paddingSize(size);
+    }
+
+    return frame;
+}
+
+/**
+ * Hand every pending batch to the persistence thread.
+ * A ledger keeps at most one batch in flight, the next one is queued
+ * again once it completes.
+ */
+void multiLedgerSync(App* app)
+{
+    PersistJob job;
+    Ledger* l;
+    char* data;
+    int submitted;
+    int keep;
+    int id;
+
+    submitted = 0;
+    keep = 0;
+    for (int i = 0; i < app->syncSize; ++i)
+    {
+        id = app->syncQueue[i];
+        l = app->ledgers + id;
+        if (!l->valid || !l->syncQueued)
+            continue;
+        if (l->flushing)
+        {
+            l->syncQueued = 0;
+            continue;
+        }
+
+        /* Submit, swapping in the spare buffer */
+        job.ledgerId = id;
+        job.fd = l->fileData;
+        job.data = l->pending;
+        job.size = l->pendingSize;
+        job.capacity = l->pendingCapacity;
+        job.offset = l->size - l->pendingSize;
+        job.count = l->count;
+        job.written = 0;
+        job.retry = l->writeErrors != 0;
+        job.indexFd = l->fileIndex;
+        job.base = l->sealedCount;
+        job.first = l->durableCount;
+        job.checkpoint = l->closing ? l->count : l->indexCheckpoint + LEDGER_INDEX_CHECKPOINT;
+        job.indexError = 0;
+        job.checkpointed = 0;
+        if (multiPersistSubmit(app, &job))
+        {
+            app->syncQueue[keep++] = id;
+            continue;
+        }
+        submitted = 1;
+        l->syncQueued = 0;
+        l->flushing = 1;
+        l->flushSize = l->pendingSize;
+        data = l->spare;
+        l->pending = data;
+        l->pendingSize = 0;
+        l->pendingCapacity = l->spareCapacity;
+        l->spare = NULL;
+        l->spareCapacity = 0;
+    }
+    app->syncSize = keep;
+
+    /* Retry shortly if the queue was full */
+    if (keep)
+        app->syncDeadline = multiTimeMs() + 1;
+    if (submitted)
+        multiPersistWake(app);
+}
+
+/**
+ * Give up on a ledger whose data file cannot be written.
+ * The entries that are not durable are dropped, they were never released,
+ * and the ledger is closed along with its clients. The next open starts
+ * over from what the data file holds.
+ */
+static void ledgerFail(App* app, PersistJob* job)
+{
+    Ledger* l;
+    int id;
+
+    id = job->ledgerId;
+    l = app->ledgers + id;
+    fprintf(stderr, "Ledger #%d: Giving up after %u write errors\n", id, l->writeErrors);
+
+    /* Back to the durable entries */
+    free(job->data);
+    job->data = NULL;
+    free(l->pending);
+    l->pending = NULL;
+    l->pendingSize = 0;
+    l->pendingCapacity = 0;
+    l->flushing = 0;
+    l->flushSize = 0;
+    l->count = l->durableCount;
+    l->size = job->offset;
+    l->failed = 1;
+
+    /* The last client gone closes the ledger, see multiLedgerRelease */
+    while (l->valid && l->clientCount)
+        multiClientDisconnect(app, APP_CLIENT(app, l->clients[l->clientCount - 1]));
+    if (l->valid && !l->refCount)
+        multiLedgerClose(app, id);
+}
+
+/**
+ * Put a batch that could not be made durable back in front of the pending
+ * entries. Nothing of it is released, it is submitted again shortly.
+ */
+static void ledgerPersistFailed(App* app, PersistJob* job)
+{
+    Ledger* l;
+    uint32_t size;
+
+    l = app->ledgers + job->ledgerId;
+    l->writeErrors++;
+    fprintf(stderr, "Ledger #%d: Write error (attempts: %u)\n", job->ledgerId, l->writeErrors);
+    if (l->writeErrors >= PERSIST_RETRY_MAX)
+    {
+        ledgerFail(app, job);
+        return;
+    }
+
+    /* The batch buffer becomes the pending one */
+    size = job->size + l->pendingSize;
+    if (size > job->capacity)
+    {
+        while (job->capacity < size)
+            job->capacity *= 2;
+        job->data = realloc(job->data, job->capacity);
+    }
+    if (l->pendingSize)
+        memcpy(job->data + job->size, l->pending, l->pendingSize);
+    if (!l->spare)
+    {
+        l->spare = l->pending;
+        l->spareCapacity = l->pendingCapacity;
+    }
+    else
+        free(l->pending);
+    l->pending = job->data;
+    l->pendingSize = size;
+    l->pendingCapacity = job->capacity;
+    job->data = NULL;
+    l->flushing = 0;
+    l->flushSize = 0;
+    ledgerIdleResize(app, l);
+
+    if (!l->syncQueued)
+        ledgerQueueSync(app, job->ledgerId, multiTimeMs() + PERSIST_RETRY_MS);
+}
+
+/**
+ * Release the batches made durable by the persistence thread to the clients.
+ * Clients that were caught up get the batch as a single shared frame, the
+ * others resume their regular catch-up.
+ */
+static void ledgerPersisted(App* app, PersistJob* job)
+{
+    Ledger* l;
+    Client* c;
+    Frame* frame;
+    uint32_t first;
+
+    l = app->ledgers + job->ledgerId;
+    if (!job->written)
+    {
+        ledgerPersistFailed(app, job);
+        return;
+    }
+    l->writeErrors = 0;
+
+    /* A hole in the index would be trusted by the next checkpoint, stop
+     * maintaining it instead */
+    if (job->indexError && l->fileIndex != -1)
+    {
+        fprintf(stderr, "Ledger #%d: Index write error\n", job->ledgerId);
+        close(l->fileIndex);
+        l->fileIndex = -1;
+    }
+    else if (job->checkpointed)
+        l->indexCheckpoint = job->count;
+
+    /* The batch is durable */
+    first = l->durableCount;
+    frame = ledgerBatchFrame(job->data, job->size, job->count - first);
+    ledgerCacheAppend(app, l, job->data, job->size);
+    l->flushing = 0;
+    l->flushSize = 0;
+    l->durableCount = job->count;
+    ledgerMap(l);
+
+    /* Keep the buffer for the next batch */
+    if (!l->spare)
+    {
+        l->spare = job->data;
+        l->spareCapacity = job->capacity;
+    }
+    else
+        free(job->data);
+    job->data = NULL;
+    ledgerIdleResize(app, l);
+
+    /* The next batch already waited for this one */
+    if (l->pendingSize && !l->syncQueued)
+        ledgerQueueSync(app, job->ledgerId, multiTimeMs());
+
+    /* Notify all clients sharing the ledger, last first so removals are safe */
+    for (int j = l->clientCount - 1; j >= 0; --j)
+    {
+        if (j >= l->clientCount)
+            continue;
+        c = APP_CLIENT(app, l->clients[j]);
+        if (frame && c->state == CL_STATE_READY && c->ledgerBase == first && !multiClientQueueFrame(app, c, frame))
+        {
+            c->ledgerBase = l->durableCount;
+            multiClientFlushLater(app, c);
+        }
+        else
+            multiClientTransferLedger(app, c);
+    }
+    if (frame)
+        frameUnref(frame);
+
+    /* Finish a deferred close, opening the ledger again cancels it */
+    if (l->valid && l->closing)
+        multiLedgerClose(app, job->ledgerId);
+}
+
+/**
+ * Called once the close job of a ledger is done.
+ * The close is finished, unless the ledger was opened again meanwhile: it
+ * is then loaded again from its new files, along with the writes it held
+ * back.
+ */
+static void ledgerClosed(App* app, PersistJob* job)
+{
+    Ledger* l;
+    LedgerLoad* load;
+    uint32_t base;
+    int id;
+
+    id = job->ledgerId;
+    l = app->ledgers + id;
+    l->compacting = 0;
+    base = job->base + (job->count - job->base) / LEDGER_SEGMENT_ENTRIES * LEDGER_SEGMENT_ENTRIES;
+    if (job->written)
+        fprintf(stderr, "Ledger #%d: Sealed %u entries (segments: %u)\n", id, base - job->base, base / LEDGER_SEGMENT_ENTRIES);
+    else if (base != job->base)
+        fprintf(stderr, "Ledger #%d: Compaction error\n", id);
+    if (job->checkpointed)
+        l->indexCheckpoint = job->count;
+
+    if (l->closing && !l->load)
+    {
+        ledgerCloseFinish(app, id);
+        return;
+    }
+
+    /* Start over from the new files */
+    load = l->load;
+    l->load = NULL;
+    ledgerCloseFiles(l);
+    if (ledgerOpenFiles(app, id, load))
+    {
+        l->failed = 1;
+        while (l->valid && l->clientCount)
+            multiClientDisconnect(app, APP_CLIENT(app, l->clients[l->clientCount - 1]));
+        if (l->valid && !l->refCount)
+            ledgerCloseFinish(app, id);
+        return;
+    }
+    ledgerIdleResize(app, l);
+    if (l->valid && l->closing)
+        multiLedgerClose(app, id);
+}
+
+/**
+ * Called when the persistence thread reports durable batches.
+ */
+void multiLedgerPersisted(App* app)
+{
+    PersistJob* job;
+    uint64_t value;
+
+    read(app->persistDoneEvent, &value, sizeof(value));
+    while ((job = multiPersistDone(app)))
+    {
+        if (job->compact)
+            ledgerClosed(app, job);
+        else
+            ledgerPersisted(app, job);
+        multiPersistRelease(app);
+    }
+}
+
+/**
+ * Make every pending entry durable, waiting for the persistence thread.
+ */
+void multiLedgerFlush(App* app)
+{
+    /* Writes held back by loading ledgers go first */
+    while (app->loadSize)
+        multiLedgerLoad(app);
+
+    while (app->syncSize || multiPersistPending(app))
+    {
+        multiLedgerSync(app);
+        if (multiPersistPending(app))
+        {
+            multiPersistWait(app);
+            multiLedgerPersisted(app);
+        }
+    }
+}
+
+/**
+ * Give up on a ledger whose data file cannot be read. The ledger is
+ * closed along with its clients, its files are left as they are.
+ */
+static void ledgerLoadFail(App* app, int id)
+{
+    Ledger* l;
+
+    l = app->ledgers + id;
+    fprintf(stderr, "Ledger #%d: Load failed\n", id);
+    ledgerLoadAbort(app, id);
+
+    /* The last client gone closes the ledger, see multiLedgerRelease */
+    while (l->valid && l->clientCount)
+        multiClientDisconnect(app, APP_CLIENT(app, l->clients[l->clientCount - 1]));
+    if (l->valid && !l->refCount)
+        multiLedgerClose(app, id);
+}
+
+/**
+ * Run a load step of every ledger being loaded.
+ * A step may close other ledgers, taking them off the queue.
+ */
+void multiLedgerLoad(App* app)
+{
+    int id;
+
+    for (int i = 0; i < app->loadSize;)
+    {
+        id = app->loadQueue[i];
+        if (app->ledgers[id].failed)
+            ledgerLoadFail(app, id);
+        else
+            ledgerLoadStep(app, id);
+        if (i < app->loadSize && app->loadQueue[i] == id)
+            ++i;
+    }
+}
+
+/**
+ * Get the epoll timeout until the next group commit is due.
+ */
+int multiLedgerSyncTimeout(App* app)
+{
+    uint64_t now;
+
+    if (!app->syncSize)
+        return -1;
+    now = multiTimeMs();
+    if (now >= app->syncDeadline)
+        return 0;
+    return (int)(app->syncDeadline - now);
 }
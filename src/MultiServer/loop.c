@@ -1,11 +1,15 @@
 #include <signal.h>
 #include <errno.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <netinet/tcp.h>
 #include <time.h>
+#include <stdatomic.h>
 #include "multi.h"
 
-static sig_atomic_t sSignaled = 0;
+/* Shared by all the workers, lock-free atomics are safe in signal handlers */
+static atomic_int sSignaled = 0;
+static atomic_uint sStats = 0;
 
 static void signalHandler(int signum)
 {
@@ -13,10 +17,30 @@ static void signalHandler(int signum)
     sSignaled = 1;
 }
 
+static void statsSignalHandler(int signum)
+{
+    (void)signum;
+    sStats++;
+}
+
+static void handleNewClient(App* app, int s)
+{
+    int one;
+
+    /* Set TCP_NODELAY */
+    one = 1;
+    setsockopt(s, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    /* Make the socket non-blocking */
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+    /* Add the client */
+    multiClientNew(app, s);
+}
+
 static void handleNewClients(App* app)
 {
     int s;
-    int one;
 
     for (;;)
     {
@@ -24,16 +48,7 @@ static void handleNewClients(App* app)
         s = accept(app->socket, NULL, NULL);
         if (s < 0)
             break;
-
-        /* Set TCP_NODELAY */
-        one = 1;
-        setsockopt(s, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
-
-        /* Make the socket non-blocking */
-        fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
-
-        /* Add the client */
-        multiClientNew(app, s);
+        handleNewClient(app, s);
     }
 }
 
@@ -44,13 +59,41 @@ static void handleTimer(App* app)
     /* Read the timer */
     read(app->timer, &value, sizeof(value));
 
-    /* Handle the timer */
-    for (int i = 0; i < app->clientSize; ++i)
-        multiClientEventTimer(app, &app->clients[i]);
+    /* Fire the due client timers */
+    while (value--)
+        multiTimerAdvance(app);
+
+    /* Close the ledgers idle for too long */
+    multiLedgerExpire(app);
+}
+
+static void handleHandoff(App* app)
+{
+    uint64_t value;
+    int* queue;
+    int size;
+
+    /* Read the event */
+    read(app->handoffEvent, &value, sizeof(value));
+
+    /* Take the queued clients */
+    pthread_mutex_lock(&app->handoffLock);
+    queue = app->handoffQueue;
+    size = app->handoffSize;
+    app->handoffQueue = NULL;
+    app->handoffSize = 0;
+    app->handoffCapacity = 0;
+    pthread_mutex_unlock(&app->handoffLock);
+
+    for (int i = 0; i < size; ++i)
+        multiClientAdopt(app, APP_CLIENT(app, queue[i]));
+    free(queue);
 }
 
 static void handleEvent(App* app, const struct epoll_event* e)
 {
+    Client* client;
+
     switch (APP_EPTYPE(e->data.u32))
     {
     case APP_EP_SOCK_SERVER:
@@ -58,20 +101,58 @@ static void handleEvent(App* app, const struct epoll_event* e)
             handleNewClients(app);
         break;
     case APP_EP_SOCK_CLIENT:
+        client = APP_CLIENT(app, APP_EPVALUE(e->data.u32));
         if (e->events & EPOLLHUP)
         {
-            multiClientDisconnect(app, &app->clients[APP_EPVALUE(e->data.u32)]);
+            multiClientDisconnect(app, client);
             break;
         }
+        app->migrated = 0;
         if (e->events & EPOLLIN)
-            multiClientEventInput(app, &app->clients[APP_EPVALUE(e->data.u32)]);
+            multiClientEventInput(app, client);
+        if (app->migrated)
+            break;
         if (e->events & EPOLLOUT)
-            multiClientEventOutput(app, &app->clients[APP_EPVALUE(e->data.u32)]);
+            multiClientEventOutput(app, client);
         break;
     case APP_EP_TIMER:
         handleTimer(app);
         break;
+    case APP_EP_HANDOFF:
+        handleHandoff(app);
+        break;
+    case APP_EP_INBOX:
+        multiProcessReceive(app);
+        break;
+    case APP_EP_PERSIST:
+        multiLedgerPersisted(app);
+        break;
+    case APP_EP_ACCEPT:
+        /* Accepted by the io_uring backend */
+        handleNewClient(app, APP_EPVALUE(e->data.u32));
+        break;
+    }
+}
+
+/**
+ * Watch an internal fd for input.
+ */
+static void runWatch(App* app, int fd, uint32_t data)
+{
+    struct epoll_event event;
+
+#if defined(MULTI_IO_URING)
+    if (app->uring)
+    {
+        multiUringWatchFd(app, fd, data);
+        return;
     }
+#endif
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = data;
+    epoll_ctl(app->epoll, EPOLL_CTL_ADD, fd, &event);
 }
 
 static void runSetup(App* app)
@@ -79,9 +160,16 @@ static void runSetup(App* app)
     struct itimerspec itsp;
     struct epoll_event event;
 
-    /* Setup signal handlers */
-    signal(SIGINT, signalHandler);
-    signal(SIGTERM, signalHandler);
+#if defined(MULTI_IO_URING)
+    /* Prefer io_uring, falling back to epoll on older kernels */
+    if (multiUringInit(app))
+        fprintf(stderr, "Server: io_uring unavailable, using epoll\n");
+#endif
+
+    /* Start the persistence thread */
+    if (multiPersistStart(app))
+        exit(1);
+    runWatch(app, app->persistDoneEvent, APP_EP_PERSIST);
 
     /* Setup the timer */
     app->timer = timerfd_create(CLOCK_MONOTONIC, 0);
@@ -95,44 +183,170 @@ static void runSetup(App* app)
     itsp.it_value.tv_sec = 1;
     itsp.it_interval.tv_sec = 1;
     timerfd_settime(app->timer, 0, &itsp, NULL);
+    runWatch(app, app->timer, APP_EP_TIMER);
 
-    memset(&event, 0, sizeof(event));
-    event.events = EPOLLIN;
-    event.data.u32 = APP_EP_TIMER;
-    epoll_ctl(app->epoll, EPOLL_CTL_ADD, app->timer, &event);
+    /* Listen, only one worker is woken up per connection */
+#if defined(MULTI_IO_URING)
+    if (app->uring)
+        multiUringAccept(app);
+    else
+#endif
+    {
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        if (app->workerCount > 1)
+            event.events |= EPOLLEXCLUSIVE;
+        event.data.u32 = APP_EP_SOCK_SERVER;
+        if (epoll_ctl(app->epoll, EPOLL_CTL_ADD, app->socket, &event) == -1)
+        {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+
+    /* Setup the handoff queue */
+    if (app->workerCount > 1)
+    {
+        app->handoffEvent = eventfd(0, EFD_NONBLOCK);
+        if (app->handoffEvent == -1)
+        {
+            perror("eventfd");
+            exit(1);
+        }
+        runWatch(app, app->handoffEvent, APP_EP_HANDOFF);
+    }
+
+    /* Clients handed off by other processes land on the first worker */
+    if (app->processCount > 1 && app->workerId == 0)
+        runWatch(app, app->processInbox, APP_EP_INBOX);
 }
 
-int multiRun(App* app)
+static int runLoop(App* app)
 {
     int eventCount;
+    int timeout;
+    int retry;
     int ret;
+    uint64_t one;
     struct epoll_event events[256];
 
-    /* Setup */
-    runSetup(app);
-
     ret = 0;
     for (;;)
     {
+        /* Ledgers being loaded only poll between steps */
+        timeout = app->loadSize ? 0 : multiLedgerSyncTimeout(app);
+        retry = multiProcessRetryTimeout(app);
+        if (retry != -1 && (timeout == -1 || retry < timeout))
+            timeout = retry;
+
         //printf("WAIT\n");
-        eventCount = epoll_wait(app->epoll, events, 256, -1);
+#if defined(MULTI_IO_URING)
+        /* The io_uring backend dispatches its completions itself */
+        if (app->uring)
+            eventCount = multiUringWait(app, timeout, handleEvent);
+        else
+#endif
+        eventCount = epoll_wait(app->epoll, events, 256, timeout);
         //printf("WAIT END %d\n", eventCount);
         if (sSignaled)
             break;
+        if (app->statsGeneration != atomic_load(&sStats))
+        {
+            app->statsGeneration = atomic_load(&sStats);
+            multiStatsDump(app);
+        }
+        if (eventCount < 0 && errno == EINTR)
+            continue;
         if (eventCount < 0)
         {
             perror("epoll_wait");
+            sSignaled = 1;
             ret = 1;
             break;
         }
 
         for (int i = 0; i < eventCount; ++i)
             handleEvent(app, &events[i]);
+
+        /* Incremental ledger loads */
+        if (app->loadSize)
+            multiLedgerLoad(app);
+
+        /* Group commit */
+        if (multiLedgerSyncTimeout(app) == 0)
+            multiLedgerSync(app);
+
+        /* Handoffs that found a full inbox */
+        if (multiProcessRetryTimeout(app) == 0)
+            multiProcessRetry(app);
+
+        /* Send everything queued during this iteration */
+        if (app->txDirtySize)
+            multiClientFlushDirty(app);
+    }
+
+    /* Wake up the other workers so they stop too */
+    one = 1;
+    for (int i = 0; i < app->workerCount && app->workers; ++i)
+    {
+        if (i != app->workerId)
+            write(app->workers[i]->handoffEvent, &one, sizeof(one));
+    }
+
+    multiStatsDump(app);
+
+    return ret;
+}
+
+static void* runWorker(void* arg)
+{
+    App* app;
+
+    app = arg;
+    app->error = runLoop(app);
+    return NULL;
+}
+
+int multiRun(App* app)
+{
+    int ret;
+
+    /* Setup signal handlers */
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
+    signal(SIGUSR1, statsSignalHandler);
+
+    /* Create the extra workers */
+    if (app->workerCount > 1)
+    {
+        app->workers = malloc(sizeof(App*) * app->workerCount);
+        app->workers[0] = app;
+        for (int i = 1; i < app->workerCount; ++i)
+        {
+            app->workers[i] = malloc(sizeof(App));
+            multiInitWorker(app->workers[i], app, i);
+        }
+    }
+
+    /* Setup */
+    for (int i = 0; i < app->workerCount; ++i)
+        runSetup(app->workers ? app->workers[i] : app);
+
+    /* Run, the calling thread being the first worker */
+    for (int i = 1; i < app->workerCount; ++i)
+        pthread_create(&app->workers[i]->thread, NULL, runWorker, app->workers[i]);
+    ret = runLoop(app);
+    for (int i = 1; i < app->workerCount; ++i)
+    {
+        pthread_join(app->workers[i]->thread, NULL);
+        if (app->workers[i]->error)
+            ret = 1;
     }
 
     /* Restore signal handlers */
     signal(SIGINT, SIG_DFL);
     signal(SIGTERM, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
 
     fprintf(stderr, "Server: Shutting down\n");
 
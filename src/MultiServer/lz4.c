@@ -0,0 +1,136 @@
+#include "multi.h"
+
+/**
+ * A compressor for the LZ4 block format.
+ * Only the greedy single-probe search of the reference fast mode is
+ * implemented, the output can be decoded by any LZ4 block decoder
+ * (LZ4_decompress_safe and friends).
+ */
+
+#define LZ4_HASH_BITS       12
+#define LZ4_MIN_MATCH       4
+#define LZ4_MAX_OFFSET      65535
+
+/* The last match must start 12 bytes before the end of the block, and the
+ * last 5 bytes are always literals */
+#define LZ4_MF_LIMIT        12
+#define LZ4_LAST_LITERALS   5
+
+static uint32_t lz4Read32(const uint8_t* p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t lz4Hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/**
+ * Write the extra bytes of a length that did not fit in its token nibble.
+ */
+static uint8_t* lz4Length(uint8_t* op, uint32_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * Write a sequence, a match length of 0 ends the block with literals only.
+ */
+static uint8_t* lz4Sequence(uint8_t* op, const uint8_t* literals, uint32_t literalLen, uint32_t offset, uint32_t matchLen)
+{
+    uint8_t* token;
+
+    token = op++;
+    *token = (uint8_t)((literalLen >= 15 ? 15 : literalLen) << 4);
+    if (literalLen >= 15)
+        op = lz4Length(op, literalLen - 15);
+    memcpy(op, literals, literalLen);
+    op += literalLen;
+    if (!matchLen)
+        return op;
+
+    op[0] = (uint8_t)offset;
+    op[1] = (uint8_t)(offset >> 8);
+    op += 2;
+    matchLen -= LZ4_MIN_MATCH;
+    *token |= (uint8_t)(matchLen >= 15 ? 15 : matchLen);
+    if (matchLen >= 15)
+        op = lz4Length(op, matchLen - 15);
+    return op;
+}
+
+/**
+ * Get the largest compressed size of size bytes.
+ */
+uint32_t lz4Bound(uint32_t size)
+{
+    return size + size / 255 + 16;
+}
+
+/**
+ * Compress a block.
+ * @param dst At least lz4Bound(size) bytes
+ * @return The compressed size
+ */
+uint32_t lz4Compress(const void* src, uint32_t size, void* dst)
+{
+    uint32_t table[1 << LZ4_HASH_BITS];
+    const uint8_t* in;
+    uint8_t* op;
+    uint32_t anchor;
+    uint32_t pos;
+    uint32_t ref;
+    uint32_t len;
+    uint32_t h;
+
+    in = src;
+    op = dst;
+    anchor = 0;
+    if (size > LZ4_MF_LIMIT)
+    {
+        memset(table, 0, sizeof(table));
+        pos = 0;
+        while (pos < size - LZ4_MF_LIMIT)
+        {
+            h = lz4Hash(lz4Read32(in + pos));
+            ref = table[h];
+            table[h] = pos;
+            if (ref >= pos || pos - ref > LZ4_MAX_OFFSET || lz4Read32(in + ref) != lz4Read32(in + pos))
+            {
+                /* Skip faster through data that does not compress */
+                pos += 1 + ((pos - anchor) >> 6);
+                continue;
+            }
+
+            /* Extend the match both ways */
+            while (pos > anchor && ref > 0 && in[pos - 1] == in[ref - 1])
+            {
+                pos--;
+                ref--;
+            }
+            len = LZ4_MIN_MATCH;
+            while (pos + len < size - LZ4_LAST_LITERALS && in[pos + len] == in[ref + len])
+                len++;
+
+            op = lz4Sequence(op, in + anchor, pos - anchor, pos - ref, len);
+            pos += len;
+            anchor = pos;
+
+            /* Matches often follow each other */
+            table[lz4Hash(lz4Read32(in + pos - 2))] = pos - 2;
+        }
+    }
+
+    op = lz4Sequence(op, in + anchor, size - anchor, 0, 0);
+    return (uint32_t)(op - (uint8_t*)dst);
+}
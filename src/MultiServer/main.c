@@ -3,7 +3,7 @@
 
 static int usage(const char* prog)
 {
-    printf("Usage: %s [-h host] [-p port] [-d dataDir]\n", prog);
+    printf("Usage: %s [-h host] [-p port] [-d dataDir] [-s syncWindowMs] [-c cacheKiB] [-r retainMiB] [-R retainSec] [-k keepaliveSec] [-T timeoutSec] [-t threads] [-P processes]\n", prog);
     return 2;
 }
 
@@ -13,6 +13,14 @@ int main(int argc, char** argv)
     const char* host;
     const char* dataDir;
     uint16_t port;
+    int syncWindow;
+    int cacheSize;
+    int retainSize;
+    int retainTtl;
+    int keepalive;
+    int timeout;
+    int threads;
+    int processes;
     int ret;
 
     /* Ignore SIGPIPE */
@@ -22,6 +30,14 @@ int main(int argc, char** argv)
     host = "0.0.0.0";
     port = 13248;
     dataDir = "data";
+    syncWindow = 0;
+    cacheSize = 256;
+    retainSize = 64;
+    retainTtl = 300;
+    keepalive = 3;
+    timeout = 30;
+    threads = 1;
+    processes = 1;
 
     for (int i = 1; i < argc; ++i)
     {
@@ -46,13 +62,81 @@ int main(int argc, char** argv)
                 return usage(argv[0]);
             dataDir = argv[i];
         }
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            i++;
+            if (i >= argc)
+                return usage(argv[0]);
+            syncWindow = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-c") == 0)
+        {
+            i++;
+            if (i >= argc)
+                return usage(argv[0]);
+            cacheSize = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            i++;
+            if (i >= argc)
+                return usage(argv[0]);
+            retainSize = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-R") == 0)
+        {
+            i++;
+            if (i >= argc)
+                return usage(argv[0]);
+            retainTtl = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-k") == 0)
+        {
+            i++;
+            if (i >= argc)
+                return usage(argv[0]);
+            keepalive = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-T") == 0)
+        {
+            i++;
+            if (i >= argc)
+                return usage(argv[0]);
+            timeout = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            i++;
+            if (i >= argc)
+                return usage(argv[0]);
+            threads = atoi(argv[i]);
+            if (threads < 1)
+                return usage(argv[0]);
+        }
+        else if (strcmp(argv[i], "-P") == 0)
+        {
+            i++;
+            if (i >= argc)
+                return usage(argv[0]);
+            processes = atoi(argv[i]);
+            if (processes < 1)
+                return usage(argv[0]);
+        }
         else
             return usage(argv[0]);
     }
 
     if (multiInit(&app, dataDir))
         return 1;
-    if (multiListen(&app, host, port))
+    app.syncWindow = syncWindow;
+    app.cacheMax = (uint32_t)cacheSize * 1024;
+    app.retainMax = (uint64_t)retainSize * 1024 * 1024;
+    app.retainTtl = retainTtl;
+    app.keepalive = keepalive;
+    app.timeout = timeout;
+    app.workerCount = threads;
+    app.processCount = processes;
+    if (multiProcessSpawn(&app) || multiListen(&app, host, port))
     {
         multiQuit(&app);
         return 1;
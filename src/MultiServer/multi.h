@@ -2,6 +2,7 @@
 #define MULTI_H
 
 #define _XOPEN_SOURCE 500
+#define _FILE_OFFSET_BITS 64
 #include <sys/epoll.h>
 #include <unistd.h>
 #include <string.h>
@@ -13,38 +14,99 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
 
-#define VERSION 0x00000200
+#define VERSION 0x00000202
+
+/* First client version allowed to send OP_TRANSFER_BATCH */
+#define VERSION_TRANSFER_BATCH 0x00000201
+
+/* First client version sent OP_TRANSFER_LZ4 during catch-up */
+#define VERSION_TRANSFER_LZ4 0x00000202
 
 #define APP_EP_SOCK_SERVER  0x00000000
 #define APP_EP_SOCK_CLIENT  0x01000000
 #define APP_EP_TIMER        0x02000000
+#define APP_EP_HANDOFF      0x03000000
+#define APP_EP_INBOX        0x04000000
+#define APP_EP_ACCEPT       0x05000000
+#define APP_EP_PERSIST      0x06000000
 #define APP_EPTYPE(x)       ((x) & 0xff000000)
 #define APP_EPVALUE(x)      ((x) & 0x00ffffff)
 
+/* Clients live in fixed chunks so their addresses never change */
+#define CLIENT_CHUNK_SIZE   256
+#define CLIENT_CHUNK_COUNT  256
+#define CLIENT_MAX          (CLIENT_CHUNK_SIZE * CLIENT_CHUNK_COUNT)
+#define APP_CLIENT(app, id) (&(app)->clients->chunks[(id) / CLIENT_CHUNK_SIZE][(id) % CLIENT_CHUNK_SIZE])
+
 #define CL_STATE_NEW        0
 #define CL_STATE_CONNECTED  1
 #define CL_STATE_READY      2
 
+/* io_uring requests in flight for a client */
+#define CLIENT_WATCH_IN     0x01
+#define CLIENT_WATCH_RECV   0x02
+#define CLIENT_WATCH_OUT    0x04
+
 #define OP_NONE             0
 #define OP_TRANSFER         1
 #define OP_MSG              2
+#define OP_TRANSFER_BATCH   3
+
+/* OP_TRANSFER_BATCH is followed by a count and that many entries, at most
+ * TRANSFER_BATCH_MAX so that a whole batch fits in the rx buffer */
+#define TRANSFER_BATCH_MAX  64
+
+/* Server to client only, a block of LEDGER_LZ4_BLOCK consecutive entries:
+ * count, raw size and compressed size as 32-bit values, then the
+ * OP_TRANSFER messages of the entries compressed in the LZ4 block format */
+#define OP_TRANSFER_LZ4     4
+#define LEDGER_LZ4_BLOCK    1024
 
 #define PACKED __attribute__((packed))
 #define BUFFER_SIZE 16384
+#define LEDGER_MAP_MIN (1024 * 1024)
+#define LEDGER_LOAD_BLOCK (1024 * 1024)
+#define LEDGER_LOAD_KEYS 65536
+#define TX_CHUNK_SIZE 4096
+#define TX_IOV_MAX 64
+#define TX_FLUSH_SIZE (BUFFER_SIZE - TX_CHUNK_SIZE)
+#define FRAME_POOL_MAX 256
+#define TIMER_WHEEL_SIZE 64
+#define TIMER_NONE 0xffffffff
+#define PERSIST_QUEUE_SIZE 4096
+#define PERSIST_RETRY_MS 100
+#define PERSIST_RETRY_MAX 10
+#define LEDGER_INDEX_MAGIC "OOMMIDX3"
+#define LEDGER_INDEX_PAGE 4096
+#define LEDGER_INDEX_CHECKPOINT 4096
+#define LEDGER_SEGMENT_MAGIC "OOMMSEG2"
+#define LEDGER_SEGMENT_ENTRIES 65536
 
+/**
+ * A set of 64-bit values, stored in groups of one 64-byte cache line.
+ */
 typedef struct
 {
-    uint64_t* data;
-    uint32_t  size;
-    uint32_t  capacity;
+    struct HsGroup* groups;
+    uint32_t        groupCount;
+    uint32_t        size;
+    uint32_t        capacity;
 }
 HashSet64;
 
 void hashset64Init(HashSet64* set);
 void hashset64Free(HashSet64* set);
+void hashset64Reserve(HashSet64* set, uint32_t count);
 void hashset64Add(HashSet64* set, uint64_t value);
 int  hashset64Contains(HashSet64* set, uint64_t value);
+uint32_t hashset64Hash(uint64_t value);
+
+uint32_t lz4Bound(uint32_t size);
+uint32_t lz4Compress(const void* src, uint32_t size, void* dst);
 
 typedef struct PACKED
 {
@@ -53,6 +115,65 @@ typedef struct PACKED
 }
 LedgerEntryHeader;
 
+/**
+ * The index file of a ledger, kept next to its head data file.
+ * The header checkpoints how many records are durable and how many data
+ * bytes they cover, records past that count are not trusted. The first
+ * record is entry base, the first one past the sealed segments.
+ */
+typedef struct PACKED
+{
+    char     magic[8];
+    uint32_t base;
+    uint32_t count;
+    uint64_t size;
+}
+LedgerIndexHeader;
+
+typedef struct PACKED
+{
+    uint64_t key;
+    uint64_t offset;
+}
+LedgerIndexRecord;
+
+/**
+ * A sealed segment file holds LEDGER_SEGMENT_ENTRIES entries packed without
+ * padding, then the offset of every entry, then their keys in ascending
+ * order, then a blocked bloom filter of the keys, and this footer last.
+ */
+typedef struct PACKED
+{
+    char     magic[8];
+    uint32_t first;
+    uint32_t count;
+    uint64_t dataSize;
+    uint32_t bloomBlocks;
+}
+LedgerSegmentFooter;
+
+typedef struct
+{
+    const char*     map;
+    size_t          mapSize;
+    const uint32_t* offsets;
+    const uint64_t* keys;
+    const uint64_t* bloom;
+    uint32_t        bloomBlocks;
+}
+LedgerSegment;
+
+int  multiSegmentOpen(LedgerSegment* seg, const char* path, uint32_t first);
+void multiSegmentClose(LedgerSegment* seg);
+int  multiSegmentWrite(const char* path, uint32_t first, uint32_t count, const char* data, uint64_t dataSize);
+int  multiSegmentContains(const LedgerSegment* seg, uint64_t key);
+const LedgerEntryHeader* multiSegmentEntry(const LedgerSegment* seg, uint32_t index);
+
+/**
+ * A ring buffer of received bytes.
+ * The capacity is a power of two, pos is the read head and size the number
+ * of stored bytes.
+ */
 typedef struct
 {
     char*       data;
@@ -62,45 +183,284 @@ typedef struct
 }
 NetworkBuffer;
 
+/**
+ * A refcounted byte buffer queued for sending.
+ * Shared frames are immutable and can be queued on any number of clients.
+ */
+typedef struct
+{
+    uint32_t    refCount;
+    int         shared;
+    uint32_t    size;
+    uint32_t    capacity;
+    char        data[];
+}
+Frame;
+
+Frame*  frameNew(uint32_t capacity);
+Frame*  frameRef(Frame* frame);
+void    frameUnref(Frame* frame);
+
+typedef struct
+{
+    Frame**     chunks;
+    uint32_t    size;
+}
+FramePool;
+
+void    framePoolInit(FramePool* pool);
+void    framePoolFree(FramePool* pool);
+Frame*  framePoolGet(FramePool* pool);
+void    framePoolPut(FramePool* pool, Frame* frame);
+
+typedef struct
+{
+    Frame*      frame;
+    uint32_t    pos;
+}
+TxSlot;
+
+typedef struct
+{
+    TxSlot*     slots;
+    uint32_t    head;
+    uint32_t    count;
+    uint32_t    capacity;
+    uint32_t    size;
+}
+TxQueue;
+
 typedef struct
 {
     int  id;
     int  valid;
     int  socket;
     int  state;
+    int  nextFree;
+    int  worker;
 
     uint32_t    version;
 
     int         ledgerId;
+    int         ledgerSlot;
     uint32_t    ledgerBase;
 
-    uint8_t     op;
-
     NetworkBuffer rx;
-    NetworkBuffer tx;
+    TxQueue       tx;
+    int           txQueued;
+
+    /* Activity ticks and timer wheel links */
+    uint32_t    lastRx;
+    uint32_t    lastTx;
+    uint32_t    timerExpire;
+    int         timerPrev;
+    int         timerNext;
 
-    int rxTimeout;
-    int txTimeout;
+    /* Bumped each time the slot is reused, io_uring backend state */
+    uint32_t    generation;
+    uint8_t     watch;
 }
 Client;
 
+/**
+ * A ledger being loaded across loop iterations.
+ * The offsets from the index file are usable right away, their keys are
+ * added to the set a run at a time. The data past the index checkpoint is
+ * then scanned a block at a time.
+ * Writes received meanwhile are held back until every key is known.
+ */
+typedef struct
+{
+    LedgerIndexRecord*  records;
+    uint32_t            recordCount;
+    uint32_t            recordPos;
+
+    uint64_t    totalSize;
+    char*       block;
+    uint32_t    blockSize;
+    uint32_t    blockOff;
+    uint64_t    scanBase;
+    uint32_t    scanCount;
+    int         presized;
+
+    char*       held;
+    uint32_t    heldSize;
+    uint32_t    heldCapacity;
+}
+LedgerLoad;
+
 typedef struct
 {
     int     valid;
     char    uuid[16];
     int     refCount;
+    int     nextFree;
+
+    /* Idle retention list links, while no client holds the ledger */
+    int         idle;
+    int         idlePrev;
+    int         idleNext;
+    uint32_t    idleSince;
+    uint64_t    idleSize;
 
     int         fileData;
-    uint32_t    indexCapacity;
-    uint32_t*   index;
+    int         fileIndex;
+    uint32_t    indexCheckpoint;
     uint32_t    count;
-    uint32_t    size;
+    uint64_t    size;
+
+    /* Entries before sealedCount live in the sealed segments, one per
+     * LEDGER_SEGMENT_ENTRIES, the others in the head data file */
+    LedgerSegment*  segments;
+    uint32_t        segmentCount;
+    uint32_t        sealedCount;
+
+    /* Head data file offset of every entry, in pages of LEDGER_INDEX_PAGE
+     * that never move once allocated. The pages of sealed entries are NULL */
+    uint64_t**  indexPages;
+    uint32_t    indexPageCount;
+    uint32_t    indexPageCapacity;
 
     HashSet64   keysSet;
+
+    /* Set while loading */
+    LedgerLoad* load;
+
+    /* Subscribed client IDs */
+    int*        clients;
+    int         clientCount;
+    int         clientCapacity;
+
+    /* Group commit */
+    char*       pending;
+    uint32_t    pendingSize;
+    uint32_t    pendingCapacity;
+    uint32_t    durableCount;
+    int         syncQueued;
+    uint32_t    writeErrors;
+    int         failed;
+
+    /* Batch being made durable by the persistence thread, and the buffer
+     * it is given back into */
+    int         flushing;
+    uint32_t    flushSize;
+    char*       spare;
+    uint32_t    spareCapacity;
+    int         closing;
+
+    /* Set while the close job of the ledger runs on the persistence thread */
+    int         compacting;
+
+    /* Read mapping of the data file */
+    const char* map;
+    size_t      mapSize;
+
+    /* Tail cache of the data file */
+    char*       cache;
+    uint64_t    cacheBase;
+    uint32_t    cacheSize;
+    uint32_t    cacheCapacity;
+    uint64_t    cacheHits;
+    uint64_t    cacheMisses;
+
+    /* Reads served from the sealed segments, neither hits nor misses */
+    uint64_t    sealedReads;
+
+    /* Compressed catch-up frames, built on demand for every aligned block
+     * of LEDGER_LZ4_BLOCK durable entries */
+    Frame**     lz4Blocks;
+    uint32_t    lz4BlockCount;
+    uint64_t    lz4Size;
 }
 Ledger;
 
 typedef struct
+{
+    uint64_t    cacheHits;
+    uint64_t    cacheMisses;
+    uint64_t    sealedReads;
+    uint64_t    ledgerHits;
+    uint64_t    ledgerLoads;
+    uint64_t    ledgerEvictions;
+    uint64_t    lz4Hits;
+    uint64_t    lz4Builds;
+    uint64_t    lz4RawBytes;
+    uint64_t    lz4Bytes;
+}
+Stats;
+
+/**
+ * A batch of ledger appends handed to the persistence thread.
+ */
+typedef struct
+{
+    int         ledgerId;
+    int         fd;
+    char*       data;
+    uint32_t    size;
+    uint32_t    capacity;
+    uint64_t    offset;
+    uint32_t    count;
+    int         written;
+
+    /* Set once an attempt at the batch failed, the data file is then
+     * truncated back to offset before the batch is written again */
+    int         retry;
+
+    /* Index records start at entry first, checkpointed once count reaches
+     * checkpoint. The index file starts at entry base */
+    int         indexFd;
+    uint32_t    base;
+    uint32_t    first;
+    uint32_t    checkpoint;
+    int         indexError;
+    int         checkpointed;
+
+    /* Set for the close job of a ledger, which seals its head data file
+     * or checkpoints its index. See multiLedgerCompact */
+    int         compact;
+    char        uuid[16];
+}
+PersistJob;
+
+/**
+ * Single producer, single consumer ring of jobs shared with the
+ * persistence thread.
+ * The worker queues jobs at tail, the thread marks them done in order,
+ * and the worker releases the done ones from head.
+ */
+typedef struct
+{
+    PersistJob      jobs[PERSIST_QUEUE_SIZE];
+    atomic_uint     head;
+    atomic_uint     done;
+    atomic_uint     tail;
+    atomic_int      stop;
+}
+PersistQueue;
+
+/**
+ * Client storage shared by every worker.
+ * Workers recycle the IDs they free themselves, the lock only guards
+ * allocating new IDs.
+ * With several processes, each one allocates every stride-th ID, and the
+ * ID of a client handed to another process moves along with it.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    int             size;
+    int             stride;
+    Client*         chunks[CLIENT_CHUNK_COUNT];
+}
+ClientPool;
+
+/**
+ * A worker: one event loop with its own epoll set, ledgers and timers.
+ * Ledgers are sharded across workers by UUID, and a client moves to the
+ * worker owning its ledger when it joins.
+ */
+typedef struct App
 {
     int         epoll;
     int         socket;
@@ -109,38 +469,176 @@ typedef struct
     const char* dataDir;
 
     /* Clients */
-    int     clientSize;
-    int     clientCapacity;
-    Client* clients;
+    ClientPool* clients;
+    int         clientFree;
+
+    /* Workers */
+    int             workerId;
+    int             workerCount;
+    struct App**    workers;
+    pthread_t       thread;
+    int             migrated;
+    int             handoffEvent;
+    pthread_mutex_t handoffLock;
+    int*            handoffQueue;
+    int             handoffSize;
+    int             handoffCapacity;
+    uint32_t        statsGeneration;
+
+    /* Clients waiting for room in the inbox of the process owning their
+     * ledger, see multiProcessRetry */
+    int*            handoffRetry;
+    int             handoffRetrySize;
+    int             handoffRetryCapacity;
+    uint64_t        handoffRetryDeadline;
+
+    /* Processes */
+    int         processId;
+    int         processCount;
+    int         processInbox;
+    int*        processPeers;
+    pid_t*      processPids;
 
     /* Ledgers */
     int     ledgerSize;
     int     ledgerCapacity;
     Ledger* ledgers;
+    int     ledgerFree;
+    int     ledgerCount;
+    int*    ledgerTable;
+    uint32_t ledgerTableCapacity;
+
+    /* Idle ledgers, least recently released first */
+    int         idleHead;
+    int         idleTail;
+    int         idleCount;
+    uint64_t    idleSize;
+    uint64_t    retainMax;
+    uint32_t    retainTtl;
+
+    /* Recycled tx chunks */
+    FramePool   framePool;
+
+    /* Group commit */
+    int         syncWindow;
+    uint64_t    syncDeadline;
+    int         syncSize;
+    int         syncCapacity;
+    int*        syncQueue;
+
+    /* Clients with tx to flush at the end of the loop iteration */
+    int         txDirtySize;
+    int         txDirtyCapacity;
+    int*        txDirty;
+
+    /* Ledgers being loaded */
+    int         loadSize;
+    int         loadCapacity;
+    int*        loadQueue;
+
+    /* Persistence thread */
+    PersistQueue*   persist;
+    pthread_t       persistThread;
+    int             persistEvent;
+    int             persistDoneEvent;
+
+    /* Ledger cache */
+    uint32_t    cacheMax;
+
+    /* Timers, in seconds */
+    uint32_t    tick;
+    uint32_t    keepalive;
+    uint32_t    timeout;
+    int         wheel[TIMER_WHEEL_SIZE];
+
+    /* io_uring backend, NULL when using epoll */
+    struct Uring*   uring;
+    struct Uring*   uringFile;
+
+    Stats       stats;
 }
 App;
 
 int multiInit(App* app, const char* dataDir);
+int multiInitWorker(App* worker, const App* app, int workerId);
 int multiQuit(App* app);
 int multiListen(App* app, const char* host, uint16_t port);
 int multiRun(App* app);
 
+int  multiProcessSpawn(App* app);
+void multiProcessQuit(App* app);
+void multiProcessHandoff(App* app, Client* client, int process);
+void multiProcessReceive(App* app);
+void multiProcessRetry(App* app);
+int  multiProcessRetryTimeout(App* app);
+
 int  multiLedgerOpen(App* app, const char* uuid);
+int  multiLedgerShard(App* app, const char* uuid);
 void multiLedgerWrite(App* app, int ledgerId, const void* data);
+const LedgerEntryHeader* multiLedgerEntry(App* app, int ledgerId, uint32_t entryId, void* scratch);
+Frame* multiLedgerBlock(App* app, int ledgerId, uint32_t block);
 void multiLedgerClose(App* app, int ledgerId);
+void multiLedgerRelease(App* app, int ledgerId);
+void multiLedgerExpire(App* app);
+void multiLedgerSubscribe(App* app, int ledgerId, Client* client);
+void multiLedgerUnsubscribe(App* app, Client* client);
+void multiLedgerSync(App* app);
+void multiLedgerPersisted(App* app);
+void multiLedgerFlush(App* app);
+void multiLedgerLoad(App* app);
+int  multiLedgerSyncTimeout(App* app);
+int  multiLedgerIndexAppend(int fd, uint32_t first, const char* data, uint64_t size, uint64_t offset);
+int  multiLedgerIndexCheckpoint(int fd, uint32_t base, uint32_t count, uint64_t size);
+void multiLedgerCompact(App* app, PersistJob* job);
+
+int         multiPersistStart(App* app);
+void        multiPersistStop(App* app);
+int         multiPersistSubmit(App* app, const PersistJob* job);
+void        multiPersistWake(App* app);
+PersistJob* multiPersistDone(App* app);
+void        multiPersistRelease(App* app);
+int         multiPersistPending(App* app);
+void        multiPersistWait(App* app);
+
+int      multiFilePread(int fd, void* dst, uint64_t off, size_t size);
+int      multiFileWrite(int fd, const void* data, size_t size);
+int      multiFileReplace(const char* path, const void* data, size_t size);
+uint64_t multiTimeMs(void);
+
+void multiStatsDump(App* app);
+
+#if defined(MULTI_IO_URING)
+int  multiUringInit(App* app);
+void multiUringQuit(App* app);
+void multiUringWatchFd(App* app, int fd, uint32_t data);
+void multiUringAccept(App* app);
+void multiUringWatch(App* app, Client* client);
+void multiUringUnwatch(App* app, Client* client);
+void multiUringWantOutput(App* app, Client* client);
+int  multiUringWait(App* app, int timeout, void (*handler)(App*, const struct epoll_event*));
+int  multiUringFileWrite(App* app, int fd, const void* data, uint32_t size, int* written);
+void multiUringFileWait(App* app);
+#endif
 
-void multiFilePread(int fd, void* dst, uint32_t off, uint32_t size);
+void multiTimerInit(App* app);
+void multiTimerSchedule(App* app, Client* client, uint32_t expire);
+void multiTimerCancel(App* app, Client* client);
+void multiTimerAdvance(App* app);
 
 /* Client */
 Client*     multiClientNew(App* app, int socket);
+Client*     multiClientImport(App* app, int id, int socket, const void* rx, uint32_t rxSize);
 void        multiClientRemove(App* app, Client* client);
 void        multiClientDisconnect(App* app, Client* client);
+void        multiClientDetach(App* app, Client* client);
+void        multiClientMigrate(App* app, Client* client, int worker);
+void        multiClientAdopt(App* app, Client* client);
 void        multiClientProcess(App* app, Client* client);
 void        multiClientProcessNew(App* app, Client* client);
 void        multiClientProcessConnected(App* app, Client* client);
 void        multiClientProcessReady(App* app, Client* client);
-void        multiClientCmdTransfer(App* app, Client* client);
-int         multiClientCmdMsg(App* app, Client* client);
+void        multiClientCmdTransfer(App* app, Client* client, const char* entry);
+void        multiClientCmdMsg(App* app, Client* client, const char* msg);
 void        multiClientEventTimer(App* app, Client* client);
 void        multiClientEventInput(App* app, Client* client);
 void        multiClientEventOutput(App* app, Client* client);
@@ -148,8 +646,12 @@ void        multiClientTransferLedger(App* app, Client* client);
 int         multiClientPeek(App* app, Client* client, void* dst, uint32_t size);
 int         multiClientRead(App* app, Client* client, void* dst, uint32_t size);
 int         multiClientWrite(App* app, Client* client, const void* data, uint32_t size);
+int         multiClientReceive(App* app, Client* client, const void* data, uint32_t size);
+int         multiClientQueueFrame(App* app, Client* client, Frame* frame);
 int         multiClientFlushIn(App* app, Client* client);
 int         multiClientFlushOut(App* app, Client* client);
+void        multiClientFlushLater(App* app, Client* client);
+void        multiClientFlushDirty(App* app);
 
 
 #endif
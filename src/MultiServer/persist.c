@@ -0,0 +1,269 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include "multi.h"
+
+/**
+ * Write and sync a job the plain way.
+ * Anything left by a failed attempt is truncated first, the job is not
+ * written at all when that fails, the data file being appended to.
+ */
+static void persistJobSync(PersistJob* job)
+{
+    if (ftruncate(job->fd, job->offset))
+    {
+        perror("ftruncate");
+        job->written = 0;
+        return;
+    }
+    job->written = !multiFileWrite(job->fd, job->data, job->size) && !fdatasync(job->fd);
+}
+
+/**
+ * Make a run of jobs durable.
+ * Every write goes out before the first fdatasync, so the syncs of the
+ * run overlap with the writeback of the others.
+ */
+static void persistBatch(App* app, uint32_t first, uint32_t last)
+{
+    PersistQueue* q;
+    PersistJob* job;
+
+    q = app->persist;
+
+#if defined(MULTI_IO_URING)
+    /* Linked write and fdatasync per job, in a single submission */
+    if (app->uringFile)
+    {
+        for (uint32_t i = first; i != last; ++i)
+        {
+            job = &q->jobs[i % PERSIST_QUEUE_SIZE];
+            if (job->retry || job->compact)
+                continue;
+            while (multiUringFileWrite(app, job->fd, job->data, job->size, &job->written))
+                multiUringFileWait(app);
+        }
+        multiUringFileWait(app);
+
+        for (uint32_t i = first; i != last; ++i)
+        {
+            job = &q->jobs[i % PERSIST_QUEUE_SIZE];
+            if (!job->written && !job->compact)
+                persistJobSync(job);
+        }
+        return;
+    }
+#endif
+
+    for (uint32_t i = first; i != last; ++i)
+    {
+        job = &q->jobs[i % PERSIST_QUEUE_SIZE];
+        if (job->compact)
+            continue;
+        job->written = !job->retry && !multiFileWrite(job->fd, job->data, job->size);
+        if (!job->written)
+            persistJobSync(job);
+    }
+    for (uint32_t i = first; i != last; ++i)
+    {
+        job = &q->jobs[i % PERSIST_QUEUE_SIZE];
+        if (job->written && !job->compact && fdatasync(job->fd))
+            persistJobSync(job);
+    }
+}
+
+/**
+ * Append the index records of a durable job, checkpointing now and then.
+ */
+static void persistIndex(PersistJob* job)
+{
+    /* A batch that is not durable is submitted again, records included */
+    if (job->indexFd == -1 || !job->written)
+        return;
+
+    job->indexError = multiLedgerIndexAppend(job->indexFd, job->first - job->base, job->data, job->size, job->offset);
+    if (!job->indexError && job->count >= job->checkpoint)
+    {
+        job->indexError = multiLedgerIndexCheckpoint(job->indexFd, job->base, job->count - job->base, job->offset + job->size);
+        job->checkpointed = !job->indexError;
+    }
+}
+
+static void* persistMain(void* arg)
+{
+    App* app;
+    PersistQueue* q;
+    uint64_t value;
+    uint32_t first;
+    uint32_t last;
+
+    app = arg;
+    q = app->persist;
+    for (;;)
+    {
+        /* Wait for jobs */
+        first = atomic_load_explicit(&q->done, memory_order_relaxed);
+        last = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (first == last)
+        {
+            if (atomic_load(&q->stop))
+                break;
+            if (read(app->persistEvent, &value, sizeof(value)) < 0 && errno != EINTR)
+            {
+                perror("read");
+                break;
+            }
+            continue;
+        }
+
+        /* Make the jobs durable, then notify the worker. Close jobs come
+         * after every batch of their ledger */
+        persistBatch(app, first, last);
+        for (uint32_t i = first; i != last; ++i)
+        {
+            if (q->jobs[i % PERSIST_QUEUE_SIZE].compact)
+                multiLedgerCompact(app, &q->jobs[i % PERSIST_QUEUE_SIZE]);
+            else
+                persistIndex(&q->jobs[i % PERSIST_QUEUE_SIZE]);
+        }
+        atomic_store_explicit(&q->done, last, memory_order_release);
+        value = 1;
+        write(app->persistDoneEvent, &value, sizeof(value));
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the persistence thread of a worker.
+ */
+int multiPersistStart(App* app)
+{
+    sigset_t all;
+    sigset_t old;
+    int ret;
+
+    app->persist = calloc(1, sizeof(PersistQueue));
+    app->persistEvent = eventfd(0, 0);
+    app->persistDoneEvent = eventfd(0, EFD_NONBLOCK);
+    if (!app->persist || app->persistEvent == -1 || app->persistDoneEvent == -1)
+    {
+        perror("eventfd");
+        return -1;
+    }
+
+    /* Signals are handled by the event loops */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ret = pthread_create(&app->persistThread, NULL, persistMain, app);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Stop the persistence thread, once every queued job is durable.
+ */
+void multiPersistStop(App* app)
+{
+    uint64_t one;
+
+    if (!app->persist)
+        return;
+
+    multiLedgerFlush(app);
+    atomic_store(&app->persist->stop, 1);
+    one = 1;
+    write(app->persistEvent, &one, sizeof(one));
+    pthread_join(app->persistThread, NULL);
+
+    close(app->persistEvent);
+    close(app->persistDoneEvent);
+    free(app->persist);
+    app->persist = NULL;
+}
+
+/**
+ * Queue a job, the thread is woken up by multiPersistWake.
+ * @return 0 on success, -1 if the queue is full
+ */
+int multiPersistSubmit(App* app, const PersistJob* job)
+{
+    PersistQueue* q;
+    uint32_t tail;
+
+    q = app->persist;
+    tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&q->head, memory_order_relaxed) == PERSIST_QUEUE_SIZE)
+        return -1;
+    q->jobs[tail % PERSIST_QUEUE_SIZE] = *job;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * Wake up the persistence thread after submitting jobs.
+ */
+void multiPersistWake(App* app)
+{
+    uint64_t one;
+
+    one = 1;
+    write(app->persistEvent, &one, sizeof(one));
+}
+
+/**
+ * Get the oldest durable job not released yet, or NULL.
+ */
+PersistJob* multiPersistDone(App* app)
+{
+    PersistQueue* q;
+    uint32_t head;
+
+    q = app->persist;
+    head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&q->done, memory_order_acquire))
+        return NULL;
+    return &q->jobs[head % PERSIST_QUEUE_SIZE];
+}
+
+/**
+ * Release the job returned by multiPersistDone.
+ */
+void multiPersistRelease(App* app)
+{
+    PersistQueue* q;
+
+    q = app->persist;
+    atomic_store_explicit(&q->head, atomic_load_explicit(&q->head, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/**
+ * Check for jobs that were queued but not released yet.
+ */
+int multiPersistPending(App* app)
+{
+    PersistQueue* q;
+
+    q = app->persist;
+    return atomic_load_explicit(&q->head, memory_order_relaxed) != atomic_load_explicit(&q->tail, memory_order_relaxed);
+}
+
+/**
+ * Block until the persistence thread reports progress.
+ */
+void multiPersistWait(App* app)
+{
+    struct pollfd pfd;
+
+    pfd.fd = app->persistDoneEvent;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, -1);
+}
@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "multi.h"
+
+/**
+ * A client handed off to another process.
+ * Followed by the bytes it had buffered, rx first, then tx. The socket
+ * itself travels as SCM_RIGHTS.
+ */
+typedef struct PACKED
+{
+    uint32_t id;
+    uint32_t version;
+    uint32_t rxSize;
+    uint32_t txSize;
+}
+ProcessHandoff;
+
+#define HANDOFF_MAX (sizeof(ProcessHandoff) + 2 * BUFFER_SIZE)
+#define HANDOFF_RETRY_MS 10
+
+/**
+ * Fork the extra listener processes.
+ * Every process gets a SEQPACKET inbox, and can write to the inbox of
+ * every other one.
+ */
+int multiProcessSpawn(App* app)
+{
+    int* inboxes;
+    int pair[2];
+    int size;
+    pid_t parent;
+    pid_t pid;
+    int ret;
+
+    if (app->processCount <= 1)
+        return 0;
+
+    app->processPeers = malloc(sizeof(int) * app->processCount);
+    app->processPids = calloc(app->processCount, sizeof(pid_t));
+    inboxes = malloc(sizeof(int) * app->processCount);
+    for (int i = 0; i < app->processCount; ++i)
+    {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, pair) == -1)
+        {
+            perror("socketpair");
+            exit(1);
+        }
+        size = 1024 * 1024;
+        setsockopt(pair[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        inboxes[i] = pair[0];
+        app->processPeers[i] = pair[1];
+    }
+
+    /* Fork */
+    ret = 0;
+    parent = getpid();
+    for (int i = 1; i < app->processCount; ++i)
+    {
+        pid = fork();
+        if (pid == -1)
+        {
+            perror("fork");
+            ret = -1;
+            break;
+        }
+        if (pid == 0)
+        {
+            /* Don't outlive the parent */
+            app->processId = i;
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != parent)
+                _exit(0);
+            break;
+        }
+        app->processPids[i] = pid;
+    }
+
+    /* Keep our own inbox only */
+    for (int i = 0; i < app->processCount; ++i)
+    {
+        if (i != app->processId)
+            close(inboxes[i]);
+    }
+    app->processInbox = inboxes[app->processId];
+    free(inboxes);
+
+    if (app->processId != 0)
+    {
+        /* The epoll instance is shared across fork, get our own */
+        close(app->epoll);
+        app->epoll = epoll_create1(0);
+        free(app->processPids);
+        app->processPids = NULL;
+    }
+
+    /* Interleave the client IDs */
+    app->clients->size = app->processId;
+    app->clients->stride = app->processCount;
+
+    return ret;
+}
+
+/**
+ * Stop the child processes.
+ */
+void multiProcessQuit(App* app)
+{
+    if (app->processCount <= 1)
+        return;
+
+    if (app->processPids)
+    {
+        for (int i = 1; i < app->processCount; ++i)
+        {
+            if (app->processPids[i] > 0)
+            {
+                kill(app->processPids[i], SIGTERM);
+                waitpid(app->processPids[i], NULL, 0);
+            }
+        }
+        free(app->processPids);
+    }
+
+    for (int i = 0; i < app->processCount; ++i)
+        close(app->processPeers[i]);
+    free(app->processPeers);
+    close(app->processInbox);
+}
+
+/**
+ * Try a handoff again shortly, the client stays here meanwhile.
+ */
+static void processRetryLater(App* app, Client* client)
+{
+    for (int i = 0; i < app->handoffRetrySize; ++i)
+    {
+        if (app->handoffRetry[i] == client->id)
+            return;
+    }
+    if (app->handoffRetrySize == app->handoffRetryCapacity)
+    {
+        app->handoffRetryCapacity = app->handoffRetryCapacity ? app->handoffRetryCapacity * 2 : 16;
+        app->handoffRetry = realloc(app->handoffRetry, sizeof(int) * app->handoffRetryCapacity);
+    }
+    if (!app->handoffRetrySize)
+        app->handoffRetryDeadline = multiTimeMs() + HANDOFF_RETRY_MS;
+    app->handoffRetry[app->handoffRetrySize++] = client->id;
+}
+
+/**
+ * Hand a joining client over to the process owning its ledger.
+ * The client is released from this process, ID included. A full inbox
+ * keeps the client here until the handoff is tried again.
+ */
+void multiProcessHandoff(App* app, Client* client, int process)
+{
+    ProcessHandoff header;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct iovec iov;
+    union
+    {
+        char            buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr  align;
+    } control;
+    const TxSlot* slot;
+    char* data;
+    uint32_t size;
+
+    header.id = client->id;
+    header.version = client->version;
+    header.rxSize = client->rx.size;
+    header.txSize = client->tx.size;
+    size = sizeof(header) + header.rxSize + header.txSize;
+    if (size > HANDOFF_MAX)
+    {
+        fprintf(stderr, "Client #%d: Too much data to hand off\n", client->id);
+        multiClientRemove(app, client);
+        return;
+    }
+
+    /* Copy the buffered data */
+    data = malloc(size);
+    memcpy(data, &header, sizeof(header));
+    multiClientPeek(app, client, data + sizeof(header), header.rxSize);
+    size = sizeof(header) + header.rxSize;
+    for (uint32_t i = 0; i < client->tx.count; ++i)
+    {
+        slot = &client->tx.slots[(client->tx.head + i) & (client->tx.capacity - 1)];
+        memcpy(data + size, slot->frame->data + slot->pos, slot->frame->size - slot->pos);
+        size += slot->frame->size - slot->pos;
+    }
+
+    /* Send, with the socket attached */
+    iov.iov_base = data;
+    iov.iov_len = size;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &client->socket, sizeof(int));
+
+    while (sendmsg(app->processPeers[process], &msg, 0) == -1)
+    {
+        if (errno == EINTR)
+            continue;
+        free(data);
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            fprintf(stderr, "Client #%d: Handoff deferred\n", client->id);
+            processRetryLater(app, client);
+            return;
+        }
+        fprintf(stderr, "Client #%d: Handoff error %d\n", client->id, errno);
+        multiClientRemove(app, client);
+        return;
+    }
+    free(data);
+    multiClientDetach(app, client);
+}
+
+/**
+ * Run the join of the clients whose handoff was deferred again.
+ */
+void multiProcessRetry(App* app)
+{
+    Client* client;
+    int* queue;
+    int size;
+
+    /* Clients deferred again go to a new queue */
+    queue = app->handoffRetry;
+    size = app->handoffRetrySize;
+    app->handoffRetry = NULL;
+    app->handoffRetrySize = 0;
+    app->handoffRetryCapacity = 0;
+
+    for (int i = 0; i < size; ++i)
+    {
+        client = APP_CLIENT(app, queue[i]);
+        if (client->valid && client->worker == app->workerId && client->state == CL_STATE_CONNECTED)
+            multiClientProcess(app, client);
+    }
+    free(queue);
+}
+
+/**
+ * Get the epoll timeout until the deferred handoffs are due.
+ */
+int multiProcessRetryTimeout(App* app)
+{
+    uint64_t now;
+
+    if (!app->handoffRetrySize)
+        return -1;
+    now = multiTimeMs();
+    if (now >= app->handoffRetryDeadline)
+        return 0;
+    return (int)(app->handoffRetryDeadline - now);
+}
+
+/**
+ * Take over the clients handed off by other processes.
+ */
+void multiProcessReceive(App* app)
+{
+    ProcessHandoff header;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct iovec iov;
+    union
+    {
+        char            buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr  align;
+    } control;
+    Client* client;
+    char* data;
+    ssize_t ret;
+    int sock;
+
+    data = malloc(HANDOFF_MAX);
+    for (;;)
+    {
+        iov.iov_base = data;
+        iov.iov_len = HANDOFF_MAX;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ret = recvmsg(app->processInbox, &msg, 0);
+        if (ret == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("recvmsg");
+            break;
+        }
+
+        /* Get the socket */
+        sock = -1;
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&sock, CMSG_DATA(cmsg), sizeof(int));
+        if (sock == -1)
+            continue;
+
+        /* Check the header */
+        if ((size_t)ret < sizeof(header) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+        {
+            fprintf(stderr, "Server: Invalid handoff\n");
+            close(sock);
+            continue;
+        }
+        memcpy(&header, data, sizeof(header));
+        if (sizeof(header) + header.rxSize + header.txSize != (size_t)ret)
+        {
+            fprintf(stderr, "Server: Invalid handoff\n");
+            close(sock);
+            continue;
+        }
+
+        /* Resume the join here */
+        client = multiClientImport(app, header.id, sock, data + sizeof(header), header.rxSize);
+        if (!client)
+            continue;
+        client->version = header.version;
+        client->state = CL_STATE_CONNECTED;
+        if (header.txSize)
+            multiClientWrite(app, client, data + sizeof(header) + header.rxSize, header.txSize);
+        fprintf(stderr, "Client #%d: Handed off to process %d\n", client->id, app->processId);
+        multiClientProcess(app, client);
+    }
+    free(data);
+}
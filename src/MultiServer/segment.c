@@ -0,0 +1,254 @@
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "multi.h"
+
+/**
+ * Sealed segments of a ledger.
+ * Once written, a segment never changes: it is read through a mapping of
+ * the whole file, its footer telling where each part starts.
+ */
+
+#define SEGMENT_BLOOM_BITS_PER_KEY  10
+#define SEGMENT_BLOOM_PROBES        7
+
+static uint64_t segmentAlign(uint64_t value, uint64_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+static uint64_t segmentOffsetsPos(const LedgerSegmentFooter* footer)
+{
+    return segmentAlign(footer->dataSize, 8);
+}
+
+static uint64_t segmentKeysPos(const LedgerSegmentFooter* footer)
+{
+    return segmentAlign(segmentOffsetsPos(footer) + sizeof(uint32_t) * (uint64_t)footer->count, 8);
+}
+
+static uint64_t segmentBloomPos(const LedgerSegmentFooter* footer)
+{
+    return segmentAlign(segmentKeysPos(footer) + sizeof(uint64_t) * (uint64_t)footer->count, 64);
+}
+
+static uint64_t segmentFileSize(const LedgerSegmentFooter* footer)
+{
+    return segmentBloomPos(footer) + 64 * (uint64_t)footer->bloomBlocks + sizeof(*footer);
+}
+
+static uint64_t segmentHash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static int segmentCompareKeys(const void* a, const void* b)
+{
+    uint64_t x;
+    uint64_t y;
+
+    x = *(const uint64_t*)a;
+    y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Get the bloom block of a hash, every probe of a key lands in the same
+ * cache line.
+ */
+static uint32_t segmentBloomBlock(uint64_t h, uint32_t bloomBlocks)
+{
+    return (uint32_t)(((h >> 32) * bloomBlocks) >> 32);
+}
+
+static void segmentBloomAdd(uint64_t* bloom, uint32_t bloomBlocks, uint64_t key)
+{
+    uint64_t* block;
+    uint64_t h;
+    uint64_t bits;
+    uint32_t bit;
+
+    h = segmentHash(key);
+    block = bloom + 8 * (size_t)segmentBloomBlock(h, bloomBlocks);
+    bits = h * 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < SEGMENT_BLOOM_PROBES; ++i)
+    {
+        bit = (uint32_t)(bits >> (i * 9)) & 511;
+        block[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+static int segmentMayContain(const LedgerSegment* seg, uint64_t key)
+{
+    const uint64_t* block;
+    uint64_t h;
+    uint64_t bits;
+    uint32_t bit;
+
+    h = segmentHash(key);
+    block = seg->bloom + 8 * (size_t)segmentBloomBlock(h, seg->bloomBlocks);
+    bits = h * 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < SEGMENT_BLOOM_PROBES; ++i)
+    {
+        bit = (uint32_t)(bits >> (i * 9)) & 511;
+        if (!(block[bit / 64] & (1ULL << (bit % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Check a segment for a key, searching its sorted keys when the bloom
+ * filter lets the key through.
+ */
+int multiSegmentContains(const LedgerSegment* seg, uint64_t key)
+{
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t mid;
+
+    if (!segmentMayContain(seg, key))
+        return 0;
+    lo = 0;
+    hi = LEDGER_SEGMENT_ENTRIES;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (seg->keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < LEDGER_SEGMENT_ENTRIES && seg->keys[lo] == key;
+}
+
+const LedgerEntryHeader* multiSegmentEntry(const LedgerSegment* seg, uint32_t index)
+{
+    return (const LedgerEntryHeader*)(seg->map + seg->offsets[index]);
+}
+
+/**
+ * Map a segment file and check that it holds the entries from first on.
+ * @return 0 on success, -1 if the segment is missing or invalid
+ */
+int multiSegmentOpen(LedgerSegment* seg, const char* path, uint32_t first)
+{
+    LedgerSegmentFooter footer;
+    const LedgerEntryHeader* last;
+    struct stat st;
+    void* map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) || (uint64_t)st.st_size < sizeof(footer) || multiFilePread(fd, &footer, st.st_size - sizeof(footer), sizeof(footer)))
+    {
+        close(fd);
+        return -1;
+    }
+    if (memcmp(footer.magic, LEDGER_SEGMENT_MAGIC, sizeof(footer.magic)) || footer.first != first || footer.count != LEDGER_SEGMENT_ENTRIES || !footer.bloomBlocks || segmentFileSize(&footer) != (uint64_t)st.st_size)
+    {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    seg->map = map;
+    seg->mapSize = st.st_size;
+    seg->offsets = (const uint32_t*)(seg->map + segmentOffsetsPos(&footer));
+    seg->keys = (const uint64_t*)(seg->map + segmentKeysPos(&footer));
+    seg->bloom = (const uint64_t*)(seg->map + segmentBloomPos(&footer));
+    seg->bloomBlocks = footer.bloomBlocks;
+
+    /* Every header must lie within the data, the offsets going up from 0.
+     * Payloads are at most 255 bytes, the offsets that follow the data keep
+     * them within the mapping */
+    if (seg->offsets[0])
+    {
+        multiSegmentClose(seg);
+        return -1;
+    }
+    for (uint32_t i = 1; i < footer.count; ++i)
+    {
+        if (seg->offsets[i] < seg->offsets[i - 1] + sizeof(*last))
+        {
+            multiSegmentClose(seg);
+            return -1;
+        }
+    }
+
+    /* The last entry must end with the data */
+    last = multiSegmentEntry(seg, footer.count - 1);
+    if (seg->offsets[footer.count - 1] + sizeof(*last) > footer.dataSize || seg->offsets[footer.count - 1] + sizeof(*last) + last->size != footer.dataSize)
+    {
+        multiSegmentClose(seg);
+        return -1;
+    }
+
+    return 0;
+}
+
+void multiSegmentClose(LedgerSegment* seg)
+{
+    if (seg->map)
+        munmap((void*)seg->map, seg->mapSize);
+    seg->map = NULL;
+    seg->mapSize = 0;
+}
+
+/**
+ * Seal count entries, packed in data, into a new segment file.
+ * @return 0 on success, -1 on error
+ */
+int multiSegmentWrite(const char* path, uint32_t first, uint32_t count, const char* data, uint64_t dataSize)
+{
+    LedgerSegmentFooter footer;
+    const LedgerEntryHeader* header;
+    char* buf;
+    uint32_t* offsets;
+    uint64_t* keys;
+    uint64_t* bloom;
+    uint64_t size;
+    uint64_t off;
+    int ret;
+
+    memcpy(footer.magic, LEDGER_SEGMENT_MAGIC, sizeof(footer.magic));
+    footer.first = first;
+    footer.count = count;
+    footer.dataSize = dataSize;
+    footer.bloomBlocks = (count * SEGMENT_BLOOM_BITS_PER_KEY + 511) / 512;
+    size = segmentFileSize(&footer);
+
+    /* Lay the whole file out in memory */
+    buf = calloc(1, size);
+    if (!buf)
+        return -1;
+    memcpy(buf, data, dataSize);
+    offsets = (uint32_t*)(buf + segmentOffsetsPos(&footer));
+    keys = (uint64_t*)(buf + segmentKeysPos(&footer));
+    bloom = (uint64_t*)(buf + segmentBloomPos(&footer));
+    off = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        header = (const LedgerEntryHeader*)(data + off);
+        offsets[i] = (uint32_t)off;
+        keys[i] = header->key;
+        segmentBloomAdd(bloom, footer.bloomBlocks, header->key);
+        off += sizeof(*header) + header->size;
+    }
+    qsort(keys, count, sizeof(*keys), segmentCompareKeys);
+    memcpy(buf + size - sizeof(footer), &footer, sizeof(footer));
+
+    ret = multiFileReplace(path, buf, size);
+    free(buf);
+
+    return ret;
+}
@@ -0,0 +1,11 @@
+#include "multi.h"
+
+void multiStatsDump(App* app)
+{
+    const Stats* s;
+
+    s = &app->stats;
+    fprintf(stderr, "Stats: Worker #%d: Ledger cache (hits: %llu, misses: %llu, sealed reads: %llu)\n", app->workerId, (unsigned long long)s->cacheHits, (unsigned long long)s->cacheMisses, (unsigned long long)s->sealedReads);
+    fprintf(stderr, "Stats: Worker #%d: Ledger retention (hits: %llu, loads: %llu, hit ratio: %.1f%%, evictions: %llu, idle: %d, bytes: %llu)\n", app->workerId, (unsigned long long)s->ledgerHits, (unsigned long long)s->ledgerLoads, s->ledgerHits + s->ledgerLoads ? 100.0 * s->ledgerHits / (s->ledgerHits + s->ledgerLoads) : 0.0, (unsigned long long)s->ledgerEvictions, app->idleCount, (unsigned long long)app->idleSize);
+    fprintf(stderr, "Stats: Worker #%d: Compressed catch-up (hits: %llu, builds: %llu, raw bytes: %llu, bytes: %llu)\n", app->workerId, (unsigned long long)s->lz4Hits, (unsigned long long)s->lz4Builds, (unsigned long long)s->lz4RawBytes, (unsigned long long)s->lz4Bytes);
+}
@@ -0,0 +1,82 @@
+#include "multi.h"
+
+/**
+ * A hashed timing wheel of one-second slots.
+ * Each slot holds an intrusive list of clients, so only clients whose
+ * deadline lands on the current tick are touched. Deadlines further than
+ * TIMER_WHEEL_SIZE ticks away simply go around the wheel again.
+ */
+
+void multiTimerInit(App* app)
+{
+    app->tick = 0;
+    for (int i = 0; i < TIMER_WHEEL_SIZE; ++i)
+        app->wheel[i] = -1;
+}
+
+void multiTimerCancel(App* app, Client* client)
+{
+    if (client->timerExpire == TIMER_NONE)
+        return;
+
+    if (client->timerPrev != -1)
+        APP_CLIENT(app, client->timerPrev)->timerNext = client->timerNext;
+    else
+        app->wheel[client->timerExpire % TIMER_WHEEL_SIZE] = client->timerNext;
+    if (client->timerNext != -1)
+        APP_CLIENT(app, client->timerNext)->timerPrev = client->timerPrev;
+    client->timerExpire = TIMER_NONE;
+}
+
+void multiTimerSchedule(App* app, Client* client, uint32_t expire)
+{
+    int* head;
+
+    multiTimerCancel(app, client);
+    if (expire <= app->tick)
+        expire = app->tick + 1;
+
+    head = &app->wheel[expire % TIMER_WHEEL_SIZE];
+    client->timerExpire = expire;
+    client->timerPrev = -1;
+    client->timerNext = *head;
+    if (*head != -1)
+        APP_CLIENT(app, *head)->timerPrev = client->id;
+    *head = client->id;
+}
+
+/**
+ * Advance the wheel by one tick and fire the clients that are due.
+ */
+void multiTimerAdvance(App* app)
+{
+    Client* client;
+    Client* next;
+    uint32_t slot;
+    int id;
+
+    app->tick++;
+    slot = app->tick % TIMER_WHEEL_SIZE;
+
+    id = app->wheel[slot];
+    while (id != -1)
+    {
+        client = APP_CLIENT(app, id);
+        id = client->timerNext;
+
+        /* Not due on this round */
+        if (client->timerExpire > app->tick)
+            continue;
+
+        multiTimerCancel(app, client);
+        multiClientEventTimer(app, client);
+
+        /* Start over if the handler moved the next client out of the slot */
+        if (id != -1)
+        {
+            next = APP_CLIENT(app, id);
+            if (next->timerExpire == TIMER_NONE || next->timerExpire % TIMER_WHEEL_SIZE != slot)
+                id = app->wheel[slot];
+        }
+    }
+}
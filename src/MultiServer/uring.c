@@ -0,0 +1,562 @@
+#define _GNU_SOURCE
+#include "multi.h"
+
+#if defined(MULTI_IO_URING)
+
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES       1024
+#define URING_FILE_ENTRIES  256
+#define URING_BUF_COUNT     256
+#define URING_BUF_SIZE      4096
+#define URING_BUF_GROUP     0
+
+/* Request kinds, in the top byte of user_data */
+#define URING_NONE          0
+#define URING_FD            1
+#define URING_ACCEPT        2
+#define URING_CLIENT_IN     3
+#define URING_CLIENT_RECV   4
+#define URING_CLIENT_OUT    5
+
+#define URING_DATA(kind, value, generation) (((uint64_t)(kind) << 56) | ((uint64_t)((value) & 0xffffff) << 32) | (generation))
+#define URING_KIND(x)       ((int)((x) >> 56))
+#define URING_VALUE(x)      ((uint32_t)((x) >> 32) & 0xffffff)
+#define URING_GENERATION(x) ((uint32_t)(x))
+
+typedef struct Uring
+{
+    int                     fd;
+    unsigned                sqEntries;
+    unsigned*               sqHead;
+    unsigned*               sqTail;
+    unsigned*               sqMask;
+    unsigned*               sqArray;
+    struct io_uring_sqe*    sqes;
+    unsigned*               cqHead;
+    unsigned*               cqTail;
+    unsigned*               cqMask;
+    struct io_uring_cqe*    cqes;
+    void*                   ringMap;
+    size_t                  ringMapSize;
+    size_t                  sqesSize;
+    unsigned                queued;
+    unsigned                inflight;
+
+    /* Provided receive buffers */
+    struct io_uring_buf_ring*   bufRing;
+    size_t                      bufRingSize;
+    char*                       bufs;
+}
+Uring;
+
+static int uringSetup(Uring* u, unsigned entries)
+{
+    struct io_uring_params p;
+    char* ring;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(SYS_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+    {
+        close(u->fd);
+        return -1;
+    }
+
+    /* Map the rings, the SQ and CQ rings share one mapping */
+    u->ringMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > u->ringMapSize)
+        u->ringMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ringMap = mmap(NULL, u->ringMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ringMap == MAP_FAILED)
+    {
+        close(u->fd);
+        return -1;
+    }
+    u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        munmap(u->ringMap, u->ringMapSize);
+        close(u->fd);
+        return -1;
+    }
+
+    ring = u->ringMap;
+    u->sqEntries = p.sq_entries;
+    u->sqHead = (unsigned*)(ring + p.sq_off.head);
+    u->sqTail = (unsigned*)(ring + p.sq_off.tail);
+    u->sqMask = (unsigned*)(ring + p.sq_off.ring_mask);
+    u->sqArray = (unsigned*)(ring + p.sq_off.array);
+    u->cqHead = (unsigned*)(ring + p.cq_off.head);
+    u->cqTail = (unsigned*)(ring + p.cq_off.tail);
+    u->cqMask = (unsigned*)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+
+    return 0;
+}
+
+static void uringFree(Uring* u)
+{
+    if (u->bufRing)
+        munmap(u->bufRing, u->bufRingSize);
+    free(u->bufs);
+    munmap(u->sqes, u->sqesSize);
+    munmap(u->ringMap, u->ringMapSize);
+    close(u->fd);
+    free(u);
+}
+
+static int uringEnter(Uring* u, unsigned wait, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags;
+    int ret;
+
+    flags = 0;
+    memset(&arg, 0, sizeof(arg));
+    if (wait)
+    {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout >= 0)
+        {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+
+    ret = (int)syscall(SYS_io_uring_enter, u->fd, u->queued, wait, flags, wait ? &arg : NULL, sizeof(arg));
+    if (ret >= 0)
+        u->queued -= ret;
+    return ret;
+}
+
+/**
+ * Get a free submission entry, submitting the queued ones if the ring is full.
+ */
+static struct io_uring_sqe* uringSqe(Uring* u)
+{
+    struct io_uring_sqe* sqe;
+    unsigned tail;
+
+    tail = *u->sqTail;
+    if (tail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) >= u->sqEntries)
+    {
+        uringEnter(u, 0, 0);
+        if (tail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) >= u->sqEntries)
+            return NULL;
+    }
+
+    sqe = &u->sqes[tail & *u->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqArray[tail & *u->sqMask] = tail & *u->sqMask;
+    __atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return sqe;
+}
+
+static void uringBufRecycle(Uring* u, unsigned bid)
+{
+    struct io_uring_buf* buf;
+    unsigned short tail;
+
+    tail = u->bufRing->tail;
+    buf = &u->bufRing->bufs[tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = (unsigned short)bid;
+    __atomic_store_n(&u->bufRing->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static int uringBufSetup(Uring* u)
+{
+    struct io_uring_buf_reg reg;
+
+    u->bufRingSize = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    u->bufRing = mmap(NULL, u->bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->bufRing == MAP_FAILED)
+    {
+        u->bufRing = NULL;
+        return -1;
+    }
+    u->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!u->bufs)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->bufRing;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (syscall(SYS_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    u->bufRing->tail = 0;
+    for (unsigned i = 0; i < URING_BUF_COUNT; ++i)
+        uringBufRecycle(u, i);
+    return 0;
+}
+
+/**
+ * Create the rings of a worker.
+ * @return 0 on success, -1 if io_uring is unavailable and epoll must be used
+ */
+int multiUringInit(App* app)
+{
+    Uring* u;
+    Uring* f;
+
+    u = malloc(sizeof(Uring));
+    f = malloc(sizeof(Uring));
+    if (uringSetup(u, URING_ENTRIES))
+    {
+        free(u);
+        free(f);
+        return -1;
+    }
+    if (uringBufSetup(u) || uringSetup(f, URING_FILE_ENTRIES))
+    {
+        uringFree(u);
+        free(f);
+        return -1;
+    }
+
+    app->uring = u;
+    app->uringFile = f;
+    return 0;
+}
+
+void multiUringQuit(App* app)
+{
+    if (!app->uring)
+        return;
+    uringFree(app->uring);
+    uringFree(app->uringFile);
+    app->uring = NULL;
+    app->uringFile = NULL;
+}
+
+/**
+ * Watch an internal fd (timer, eventfd, inbox) for input.
+ * Completions are reported as an EPOLLIN event carrying data.
+ */
+void multiUringWatchFd(App* app, int fd, uint32_t data)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = uringSqe(app->uring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_DATA(URING_FD, fd, data);
+}
+
+void multiUringAccept(App* app)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = uringSqe(app->uring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = app->socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = URING_DATA(URING_ACCEPT, 0, 0);
+}
+
+/**
+ * Arm the input side of a client.
+ * Joining clients use one-shot polls and the regular read path, so that
+ * nothing is in flight when they move to another worker. Ready clients
+ * get a multishot recv into the provided buffers.
+ */
+static void clientArm(App* app, Client* client)
+{
+    struct io_uring_sqe* sqe;
+
+    if (client->watch & (CLIENT_WATCH_IN | CLIENT_WATCH_RECV))
+        return;
+    sqe = uringSqe(app->uring);
+    if (!sqe)
+        return;
+    sqe->fd = client->socket;
+    if (client->state == CL_STATE_READY)
+    {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->user_data = URING_DATA(URING_CLIENT_RECV, client->id, client->generation);
+        client->watch |= CLIENT_WATCH_RECV;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = URING_DATA(URING_CLIENT_IN, client->id, client->generation);
+        client->watch |= CLIENT_WATCH_IN;
+    }
+}
+
+void multiUringWatch(App* app, Client* client)
+{
+    client->watch = 0;
+    clientArm(app, client);
+}
+
+/**
+ * Cancel everything in flight for a client.
+ * Submitted right away, as the socket is about to be closed or moved.
+ */
+void multiUringUnwatch(App* app, Client* client)
+{
+    struct io_uring_sqe* sqe;
+
+    if (!client->watch)
+        return;
+    client->watch = 0;
+    sqe = uringSqe(app->uring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = client->socket;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = URING_DATA(URING_NONE, 0, 0);
+    uringEnter(app->uring, 0, 0);
+}
+
+/**
+ * Called when the socket of a client is full.
+ */
+void multiUringWantOutput(App* app, Client* client)
+{
+    struct io_uring_sqe* sqe;
+
+    if (!app->uring || (client->watch & CLIENT_WATCH_OUT))
+        return;
+    sqe = uringSqe(app->uring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client->socket;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = URING_DATA(URING_CLIENT_OUT, client->id, client->generation);
+    client->watch |= CLIENT_WATCH_OUT;
+}
+
+/**
+ * Get the client targeted by a completion, if it is still the same one
+ * and still on this worker.
+ */
+static Client* uringClient(App* app, uint64_t data)
+{
+    Client* client;
+    uint32_t id;
+
+    id = URING_VALUE(data);
+    if (id >= CLIENT_MAX || !app->clients->chunks[id / CLIENT_CHUNK_SIZE])
+        return NULL;
+    client = APP_CLIENT(app, id);
+    if (!client->valid || client->generation != URING_GENERATION(data) || client->worker != app->workerId)
+        return NULL;
+    return client;
+}
+
+static void uringComplete(App* app, const struct io_uring_cqe* cqe, void (*handler)(App*, const struct epoll_event*))
+{
+    struct epoll_event e;
+    Client* client;
+    uint32_t bid;
+    int kind;
+
+    kind = URING_KIND(cqe->user_data);
+    e.events = 0;
+    switch (kind)
+    {
+    case URING_FD:
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            multiUringWatchFd(app, URING_VALUE(cqe->user_data), URING_GENERATION(cqe->user_data));
+        if (cqe->res < 0)
+            return;
+        e.events = EPOLLIN;
+        e.data.u32 = URING_GENERATION(cqe->user_data);
+        handler(app, &e);
+        return;
+    case URING_ACCEPT:
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            multiUringAccept(app);
+        if (cqe->res < 0)
+        {
+            if (cqe->res != -ECANCELED && cqe->res != -EAGAIN)
+                fprintf(stderr, "Server: Accept error %d\n", -cqe->res);
+            return;
+        }
+        e.events = EPOLLIN;
+        e.data.u32 = APP_EP_ACCEPT | (uint32_t)cqe->res;
+        handler(app, &e);
+        return;
+    }
+
+    client = uringClient(app, cqe->user_data);
+    switch (kind)
+    {
+    case URING_CLIENT_IN:
+        if (!client)
+            return;
+        client->watch &= ~CLIENT_WATCH_IN;
+        e.events = (cqe->res < 0 || (cqe->res & (POLLHUP | POLLERR))) ? EPOLLHUP : EPOLLIN;
+        break;
+    case URING_CLIENT_OUT:
+        if (!client)
+            return;
+        client->watch &= ~CLIENT_WATCH_OUT;
+        if (cqe->res < 0)
+            return;
+        e.events = EPOLLOUT;
+        break;
+    case URING_CLIENT_RECV:
+        if (client && !(cqe->flags & IORING_CQE_F_MORE))
+            client->watch &= ~CLIENT_WATCH_RECV;
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (client && cqe->res > 0 && multiClientReceive(app, client, app->uring->bufs + (size_t)bid * URING_BUF_SIZE, (uint32_t)cqe->res))
+            {
+                fprintf(stderr, "Client #%d: Receive buffer overflow\n", client->id);
+                multiClientRemove(app, client);
+                client = NULL;
+            }
+            uringBufRecycle(app->uring, bid);
+        }
+        if (!client)
+            return;
+        if (cqe->res == -ENOBUFS)
+            break;
+        e.events = cqe->res > 0 ? EPOLLIN : EPOLLHUP;
+        break;
+    default:
+        return;
+    }
+
+    /* Dispatch, then re-arm unless the client is gone or moved */
+    if (e.events)
+    {
+        app->migrated = 0;
+        e.data.u32 = APP_EP_SOCK_CLIENT | client->id;
+        handler(app, &e);
+        if (app->migrated || !client->valid)
+            return;
+    }
+    clientArm(app, client);
+}
+
+/**
+ * Submit the queued requests, wait for completions and dispatch them.
+ * @return 0 on success, -1 on error with errno set
+ */
+int multiUringWait(App* app, int timeout, void (*handler)(App*, const struct epoll_event*))
+{
+    struct io_uring_cqe cqe;
+    Uring* u;
+    unsigned head;
+    int ret;
+
+    u = app->uring;
+    ret = uringEnter(u, 1, timeout);
+    if (ret < 0 && errno != ETIME)
+        return -1;
+
+    /* Copy and release each completion first, handlers may submit more */
+    for (;;)
+    {
+        head = *u->cqHead;
+        if (head == __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE))
+            break;
+        cqe = u->cqes[head & *u->cqMask];
+        __atomic_store_n(u->cqHead, head + 1, __ATOMIC_RELEASE);
+        uringComplete(app, &cqe, handler);
+    }
+
+    return 0;
+}
+
+/**
+ * Queue a linked append and fdatasync.
+ * written is set to 1 once both completed, see multiUringFileWait.
+ * @return 0 on success, -1 if the ring is full and must be waited on first
+ */
+int multiUringFileWrite(App* app, int fd, const void* data, uint32_t size, int* written)
+{
+    struct io_uring_sqe* sqe;
+    Uring* f;
+
+    f = app->uringFile;
+    if (f->inflight + 2 > f->sqEntries)
+        return -1;
+
+    *written = 0;
+    sqe = uringSqe(f);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = size;
+    sqe->off = (uint64_t)-1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = URING_DATA(URING_NONE, 0, 0);
+
+    sqe = uringSqe(f);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = (uint64_t)(uintptr_t)written;
+
+    f->inflight += 2;
+    return 0;
+}
+
+/**
+ * Submit the queued file writes in one call, and wait for all of them.
+ * A short or failed write cancels its fdatasync, leaving written at 0.
+ */
+void multiUringFileWait(App* app)
+{
+    struct io_uring_cqe* cqe;
+    Uring* f;
+    unsigned head;
+
+    f = app->uringFile;
+    while (f->inflight)
+    {
+        if (uringEnter(f, 1, -1) < 0 && errno != EINTR)
+        {
+            perror("io_uring_enter");
+            return;
+        }
+        for (;;)
+        {
+            head = *f->cqHead;
+            if (head == __atomic_load_n(f->cqTail, __ATOMIC_ACQUIRE))
+                break;
+            cqe = &f->cqes[head & *f->cqMask];
+            if (cqe->user_data && cqe->res == 0)
+                *(int*)(uintptr_t)cqe->user_data = 1;
+            __atomic_store_n(f->cqHead, head + 1, __ATOMIC_RELEASE);
+            f->inflight--;
+        }
+    }
+}
+
+#endif
@@ -1,16 +1,84 @@
+#include <errno.h>
+#include <time.h>
 #include "multi.h"
 
-void multiFilePread(int fd, void* dst, uint32_t off, uint32_t size)
+/**
+ * Read exactly size bytes at off.
+ * @return 0 on success, -1 on error or if the file is too short
+ */
+int multiFilePread(int fd, void* dst, uint64_t off, size_t size)
 {
     ssize_t ret;
 
     while (size)
     {
         ret = pread(fd, dst, size, off);
-        if (ret < 0)
-            return;
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
         size -= ret;
         off += ret;
         dst = (char*)dst + ret;
     }
+
+    return 0;
+}
+
+/**
+ * Write exactly size bytes at the current position.
+ * @return 0 on success, -1 on error
+ */
+int multiFileWrite(int fd, const void* data, size_t size)
+{
+    ssize_t ret;
+
+    while (size)
+    {
+        ret = write(fd, data, size);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        size -= ret;
+        data = (const char*)data + ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Replace a file with new contents.
+ * The contents are made durable under a temporary name first, then moved
+ * in place, so the file is either the old one or the new one.
+ * @return 0 on success, -1 on error
+ */
+int multiFileReplace(const char* path, const void* data, size_t size)
+{
+    char tmpPath[600];
+    int fd;
+    int ret;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+    ret = multiFileWrite(fd, data, size) || fdatasync(fd) ? -1 : 0;
+    close(fd);
+    if (!ret && rename(tmpPath, path))
+        ret = -1;
+    if (ret)
+        unlink(tmpPath);
+
+    return ret;
+}
+
+uint64_t multiTimeMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/**
+ * A ledger whose data file cannot be written must never release its
+ * entries: the writer is disconnected without an echo, and the other
+ * ledgers keep working.
+ * The failing data file is a symlink to /dev/full.
+ */
+
+#define OP_NONE     0
+#define OP_TRANSFER 1
+
+static int fail(const char* msg)
+{
+    fprintf(stderr, "FAIL: %s\n", msg);
+    return 1;
+}
+
+static int removeEntry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+static void uuidPath(char* buf, size_t size, const char* dir, uint8_t byte, int full)
+{
+    int len;
+
+    len = snprintf(buf, size, "%s/ledgers/%02x", dir, byte);
+    if (full)
+    {
+        buf[len++] = '/';
+        for (int i = 0; i < 15; ++i)
+            len += snprintf(buf + len, size - len, "%02x", byte);
+    }
+}
+
+static int readAll(int fd, void* dst, size_t size)
+{
+    ssize_t ret;
+
+    while (size)
+    {
+        ret = recv(fd, dst, size, 0);
+        if (ret <= 0)
+            return -1;
+        dst = (char*)dst + ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+/**
+ * Connect to a ledger and send one entry.
+ * @return The socket, -1 on error
+ */
+static int joinAndWrite(int port, uint8_t uuidByte, uint64_t key)
+{
+    struct sockaddr_in addr;
+    struct timeval tv;
+    char buf[64];
+    uint32_t tmp32;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    /* The server may still be starting */
+    fd = -1;
+    for (int i = 0; i < 100; ++i)
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (!connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+            break;
+        close(fd);
+        fd = -1;
+        usleep(50000);
+    }
+    if (fd == -1)
+        return -1;
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    /* Handshake */
+    memcpy(buf, "OOMM2", 5);
+    tmp32 = 0x200;
+    memcpy(buf + 5, &tmp32, 4);
+    memset(buf + 9, uuidByte, 16);
+    tmp32 = 0;
+    memcpy(buf + 25, &tmp32, 4);
+    if (send(fd, buf, 29, 0) != 29 || readAll(fd, buf, 11) || memcmp(buf, "OOMM2", 5))
+    {
+        close(fd);
+        return -1;
+    }
+
+    /* Entry */
+    buf[0] = OP_TRANSFER;
+    memcpy(buf + 1, &key, 8);
+    buf[9] = 4;
+    memcpy(buf + 10, "abcd", 4);
+    if (send(fd, buf, 14, 0) != 14)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Skip keepalives until the next message, for at most 10 seconds.
+ * @return The op, -1 on EOF or timeout, errno being ETIMEDOUT for the latter
+ */
+static int nextOp(int fd)
+{
+    time_t deadline;
+    uint8_t op;
+
+    deadline = time(NULL) + 10;
+    do
+    {
+        if (readAll(fd, &op, 1))
+            return -1;
+        if (time(NULL) >= deadline)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    while (op == OP_NONE);
+    return op;
+}
+
+static int run(const char* dir, int port)
+{
+    char path[512];
+    char target[560];
+    char buf[13];
+    uint64_t key;
+    int fd;
+
+    /* The first ledger can be opened, but never written */
+    snprintf(path, sizeof(path), "%s/ledgers", dir);
+    mkdir(path, 0755);
+    uuidPath(path, sizeof(path), dir, 0x07, 0);
+    mkdir(path, 0755);
+    uuidPath(path, sizeof(path), dir, 0x07, 1);
+    mkdir(path, 0755);
+    snprintf(target, sizeof(target), "%s/data", path);
+    if (symlink("/dev/full", target))
+        return fail("symlink");
+
+    fd = joinAndWrite(port, 0x07, 1);
+    if (fd == -1)
+        return fail("join the failing ledger");
+    errno = 0;
+    if (nextOp(fd) != -1 || errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT)
+    {
+        close(fd);
+        return fail("the failing ledger must disconnect without an echo");
+    }
+    close(fd);
+
+    /* Other ledgers are unaffected */
+    fd = joinAndWrite(port, 0x08, 42);
+    if (fd == -1)
+        return fail("join a healthy ledger");
+    if (nextOp(fd) != OP_TRANSFER || readAll(fd, buf, 13) || (memcpy(&key, buf, 8), key != 42))
+    {
+        close(fd);
+        return fail("the healthy ledger must echo its entry");
+    }
+    close(fd);
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    char dir[] = "/tmp/multiserver-test-XXXXXX";
+    char portStr[16];
+    pid_t pid;
+    int port;
+    int ret;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s multiserver\n", argv[0]);
+        return 2;
+    }
+    if (!mkdtemp(dir))
+        return fail("mkdtemp");
+    port = 20000 + getpid() % 20000;
+    snprintf(portStr, sizeof(portStr), "%d", port);
+
+    pid = fork();
+    if (pid == 0)
+    {
+        execl(argv[1], argv[1], "-h", "127.0.0.1", "-p", portStr, "-d", dir, (char*)NULL);
+        perror("execl");
+        _exit(127);
+    }
+    if (pid == -1)
+        return fail("fork");
+
+    ret = run(dir, port);
+
+    /* A server stuck on the failing ledger would not shut down */
+    kill(pid, ret ? SIGKILL : SIGTERM);
+    waitpid(pid, NULL, 0);
+    nftw(dir, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+
+    if (!ret)
+        printf("PASS\n");
+    return ret;
+}